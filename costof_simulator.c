@@ -15,6 +15,7 @@
 
 #include "costof_simulator.h"
 #include "linux_uart.h"
+#include "cws_recorder.h"
 
 void* fastMalloc(int size){
 	void *mem = malloc(size);
@@ -30,7 +31,9 @@ int les_writeLine(int fd, int timeoutMs, char* line){
 }
 
 int les_write(int fd, int timeoutMs, char* buff, int nbChars) {
-	return linux_write_uart(fd, buff, nbChars);
+	int r = linux_write_uart(fd, buff, nbChars);
+	recorder_add(RECORDER_TX, buff, r);
+	return r;
 }
 
 
@@ -39,7 +42,8 @@ int les_open_serial_port(char* device, int baudrate) {
 }
 
 int les_read(int fd, int timeoutMs, char* buff, int nbChars){
-	int r = linux_read_uart(fd, buff, nbChars, timeoutMs);
+	int r = linux_read_uart(fd, buff, nbChars, 1000L*timeoutMs);
+	recorder_add(RECORDER_RX, buff, r);
 	return r;
 }
 
@@ -122,9 +126,22 @@ double linux_get_epoch_time(){
 	return (double)epoch;
 }
 
+/*
+ * Seconds from an arbitrary point, not affected by changes in the system clock.
+ * To be used to measure intervals
+ */
+double linux_get_monotonic_time(){
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+		return -1.0;
+	}
+	return (double)ts.tv_sec + ((double)ts.tv_nsec) / 1e9;
+}
+
 int speLOG(int level,  const char *format, ...){
 	va_list	__ap;
 	va_start(__ap, format);
+	flockfile(stdout); // lines of different threads are not mixed
 	set_log_colour(level);
 
 	time_t rawtime;
@@ -146,5 +163,6 @@ int speLOG(int level,  const char *format, ...){
 	printf("\r\n");
 	printf(KNRM);
 	fflush(stdout);
+	funlockfile(stdout);
 	return 0;
 }
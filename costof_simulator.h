@@ -12,12 +12,39 @@
 #define COSTOF_SIMULATOR_H
 
 #include <stdarg.h>
+#include <pthread.h>
+#include "cws_watchdog.h"
+#include "cws_histogram.h"
+#include "cws_checkpoint.h"
+#include "cws_health.h"
 
 void* fastMalloc(int size);
 
 
 typedef struct {
 	int fd; // serial port fd
+	char device[256]; // serial device, kept to reopen the port on recovery
+	int baudrate;
+	cws_watchdog wd; // link watchdog
+	cws_checkpoint ckpt; // phase of the cycle in progress
+
+	int state;               // last state reported by the sensor (cws_state)
+	double state_time;       // when the state was received (monotonic secs)
+	pthread_mutex_t sample_lock; // last_sample is written by the sample pipeline worker
+	pthread_mutex_t process_lock; // serializes the sample post-processing (the history writer is not reentrant)
+	char last_sample[256];   // last sample frame received
+	double last_sample_time; // when the last sample was received (epoch secs)
+
+	unsigned long frames_ok;  // responses parsed successfully
+	unsigned long frames_bad; // responses with an unexpected format
+
+	double last_tx_time;      // when the last command was sent (monotonic secs)
+	cws_histogram rtt;        // command round trip times (command sent -> response or prompt)
+	unsigned long cycles;
+	unsigned long cycles_failed;
+	unsigned long cycles_missed; // slots skipped because the previous cycle overran
+
+	cws_health health;        // telemetry harvested from the status polls
 }LibSensor;
 
 
@@ -30,6 +57,9 @@ int les_write(int fd, int timeoutMs, char* buff, int nbChars);
 
 int speLOG(int level,  const char *format, ...);
 
+double linux_get_epoch_time();
+double linux_get_monotonic_time();
+
 
 void fastFree(void* p);
 void* fastMalloc(int size);
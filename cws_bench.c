@@ -0,0 +1,395 @@
+/*
+ * Fleet-scale load generator and scaling benchmark, see cws_bench.h
+ */
+
+#define _GNU_SOURCE // ptsname_r, ppoll
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "cws_bench.h"
+#include "cws_histogram.h"
+#include "costof_simulator.h"
+
+typedef enum {
+	EMU_IDLE = 0,
+	EMU_OPERATING
+}emu_state;
+
+typedef struct {
+	int master;
+	int slave;             // kept open so the master doesn't see a hang up between drivers
+	char name[64];
+	emu_state state;
+	double until;          // end of the emulated measurement, 0 if none
+	char rx[256];
+	int rxlen;
+	char tx[256];
+	int txlen;
+	int txpos;             // bytes of the answer already written
+	double tx_time;        // when the next byte of the answer has to be written
+}emu_sensor;
+
+typedef struct {
+	int sensors;
+	double wall;
+	double cpu;            // user + system time of all the drivers
+	long max_rss_kb;
+	long ctx_switches;
+	double emulator_cpu;
+	unsigned long cycles;
+	unsigned long failed;
+	unsigned long missed;
+	cws_histogram rtt;
+}bench_result;
+
+
+/*
+ * Builds the answer of the emulated sensor to a command line
+ */
+static void emu_command(emu_sensor* s, const char* cmd, double now, double meas_secs){
+	long epoch = (long)time(NULL);
+	const char* state_str = (s->state == EMU_OPERATING) ? "OPERATING" : "IDLE";
+
+	if (!strcmp(cmd, "GETSTATUS")) {
+		s->txlen = snprintf(s->tx, sizeof(s->tx), "CWS10101,4,%ld,%ld,11.5,27.8,%s,0\r\nWETCHEM>", epoch, epoch, state_str);
+	}
+	else if (!strcmp(cmd, "GETSAMPLE")) {
+		s->txlen = snprintf(s->tx, sizeof(s->tx), "CWS10101,4,%ld,8.123,1,0.1234,1.1234,20.0,11.5,27.8\r\nWETCHEM>", epoch);
+	}
+	else {
+		if (!strcmp(cmd, "START")) {
+			s->state = EMU_OPERATING;
+			s->until = now + meas_secs;
+		}
+		else if (!strcmp(cmd, "SPECIAL1") || !strcmp(cmd, "SPECIAL2")) {
+			s->state = EMU_OPERATING;
+			s->until = 0;
+		}
+		else if (!strcmp(cmd, "STOP")) {
+			s->state = EMU_IDLE;
+			s->until = 0;
+		}
+		s->txlen = snprintf(s->tx, sizeof(s->tx), "\r\nWETCHEM>");
+	}
+	// the answer is written byte by byte at the pace of the line
+	s->txpos = 0;
+	s->tx_time = now + BENCH_PROCESSING_MS/1000.0;
+}
+
+
+/*
+ * Writes the bytes of the pending answer that are due, as a 9600 bauds line
+ * would deliver them. Returns the time the next byte is due or 0 if the answer
+ * is complete
+ */
+static double emu_transmit(emu_sensor* s, double now){
+	int n;
+	if (s->txpos >= s->txlen) {
+		return 0;
+	}
+	if (s->tx_time > now) {
+		return s->tx_time;
+	}
+	// normally a single byte, more if the emulator fell behind
+	n = 1 + (int)((now - s->tx_time)*1e6/BENCH_BYTE_US);
+	if (n > s->txlen - s->txpos) {
+		n = s->txlen - s->txpos;
+	}
+	if (write(s->master, &s->tx[s->txpos], n) < 0) {
+		s->txpos = s->txlen = 0; // nobody listening, drop the answer
+		return 0;
+	}
+	s->txpos += n;
+	s->tx_time += n*BENCH_BYTE_US/1e6;
+	return (s->txpos < s->txlen) ? s->tx_time : 0;
+}
+
+
+/*
+ * Emulator main loop, serves all the sensors until killed
+ */
+static void emu_run(emu_sensor* sensors, int n, double meas_secs){
+	struct pollfd* pfds = fastMalloc(n*sizeof(struct pollfd));
+	int i;
+
+	for (i = 0 ; i < n ; i++) {
+		pfds[i].fd = sensors[i].master;
+		pfds[i].events = POLLIN;
+	}
+	while (1) {
+		double now = linux_get_monotonic_time();
+		double wake = now + 0.1;
+		struct timespec timeout;
+		for (i = 0 ; i < n ; i++) {
+			emu_sensor* s = &sensors[i];
+			double next = emu_transmit(s, now);
+			if (next > 0 && next < wake) {
+				wake = next;
+			}
+			if (s->state == EMU_OPERATING && s->until > 0 && now >= s->until) {
+				s->state = EMU_IDLE;
+				s->until = 0;
+			}
+		}
+		// bytes are about 1 ms apart, poll with a sub-millisecond timeout
+		wake = (wake > now) ? wake - now : 0;
+		timeout.tv_sec = (time_t)wake;
+		timeout.tv_nsec = (long)((wake - timeout.tv_sec)*1e9);
+		if (ppoll(pfds, n, &timeout, NULL) <= 0) {
+			continue;
+		}
+		now = linux_get_monotonic_time();
+		for (i = 0 ; i < n ; i++) {
+			emu_sensor* s = &sensors[i];
+			if (!(pfds[i].revents & POLLIN)) {
+				continue;
+			}
+			int r = read(s->master, &s->rx[s->rxlen], sizeof(s->rx) - 1 - s->rxlen);
+			if (r <= 0) {
+				continue;
+			}
+			s->rxlen += r;
+			s->rx[s->rxlen] = 0;
+			char* nl;
+			while ((nl = strchr(s->rx, '\n')) != NULL) {
+				*nl = 0;
+				s->rx[strcspn(s->rx, "\r")] = 0;
+				emu_command(s, s->rx, now, meas_secs);
+				s->rxlen -= (nl + 1 - s->rx);
+				memmove(s->rx, nl + 1, s->rxlen + 1);
+			}
+			if (s->rxlen >= (int)sizeof(s->rx) - 1) {
+				s->rxlen = 0; // garbage, discard
+			}
+		}
+	}
+}
+
+
+/*
+ * Creates the pseudo terminal pair of an emulated sensor
+ */
+static int emu_open(emu_sensor* s){
+	memset(s, 0, sizeof(emu_sensor));
+	s->master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (s->master < 0 || grantpt(s->master) < 0 || unlockpt(s->master) < 0 ||
+			ptsname_r(s->master, s->name, sizeof(s->name)) != 0) {
+		return -1;
+	}
+	s->slave = open(s->name, O_RDWR | O_NOCTTY);
+	return (s->slave < 0) ? -1 : 0;
+}
+
+
+/*
+ * Adds the statistics of a driver (its metrics file) to the result
+ */
+static void bench_read_metrics(const char* path, bench_result* res){
+	char line[4096];
+	unsigned long value;
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		return;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "cycles %lu", &value) == 1) {
+			res->cycles += value;
+		} else if (sscanf(line, "cycles_failed %lu", &value) == 1) {
+			res->failed += value;
+		} else if (sscanf(line, "cycles_missed %lu", &value) == 1) {
+			res->missed += value;
+		} else if (!strncmp(line, "rtt_hist ", 9)) {
+			hist_parse(&res->rtt, line + 9);
+		}
+	}
+	fclose(f);
+}
+
+
+/*
+ * Runs the benchmark with n sensors
+ */
+static int bench_run(int n, int cycles, int period, double meas_secs, int framing, const char* exe, const char* dir, bench_result* res){
+	emu_sensor* sensors = fastMalloc(n*sizeof(emu_sensor));
+	pid_t* pids = fastMalloc(n*sizeof(pid_t));
+	pid_t emu;
+	struct rusage ru;
+	int status;
+	int i;
+
+	memset(res, 0, sizeof(bench_result));
+	res->sensors = n;
+	for (i = 0 ; i < n ; i++) {
+		if (emu_open(&sensors[i]) < 0) {
+			speLOG(LOG_ERR, "bench: could not create pseudo terminal %d", i);
+			return -1;
+		}
+	}
+
+	emu = fork();
+	if (emu == 0) {
+		emu_run(sensors, n, meas_secs);
+		_exit(0);
+	}
+	for (i = 0 ; i < n ; i++) {
+		close(sensors[i].master);
+		close(sensors[i].slave);
+	}
+
+	double start = linux_get_monotonic_time();
+	for (i = 0 ; i < n ; i++) {
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			char log[512], metrics[512], ncycles[16], nperiod[16];
+			snprintf(log, sizeof(log), "%s/driver.%d.log", dir, i);
+			snprintf(metrics, sizeof(metrics), "%s/metrics.%d", dir, i);
+			snprintf(ncycles, sizeof(ncycles), "%d", cycles);
+			snprintf(nperiod, sizeof(nperiod), "%d", period);
+			int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd >= 0) {
+				dup2(fd, STDOUT_FILENO);
+				dup2(fd, STDERR_FILENO);
+				close(fd);
+			}
+			execl(exe, exe, "-d", sensors[i].name, "-n", ncycles, "-p", nperiod, "-m", metrics,
+					framing ? "-F" : (char*)NULL, (char*)NULL);
+			_exit(127);
+		}
+	}
+
+	for (i = 0 ; i < n ; i++) {
+		if (wait4(pids[i], &status, 0, &ru) < 0) {
+			continue;
+		}
+		res->cpu += ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6;
+		res->ctx_switches += ru.ru_nvcsw + ru.ru_nivcsw;
+		if (ru.ru_maxrss > res->max_rss_kb) {
+			res->max_rss_kb = ru.ru_maxrss;
+		}
+	}
+	res->wall = linux_get_monotonic_time() - start;
+
+	kill(emu, SIGKILL);
+	if (wait4(emu, &status, 0, &ru) >= 0) {
+		res->emulator_cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6;
+	}
+
+	for (i = 0 ; i < n ; i++) {
+		char metrics[512];
+		snprintf(metrics, sizeof(metrics), "%s/metrics.%d", dir, i);
+		bench_read_metrics(metrics, res);
+	}
+	fastFree(sensors);
+	fastFree(pids);
+	return 0;
+}
+
+
+static void bench_usage(){
+	printf("usage: driver bench [-n sensors] [-c cycles] [-p period_secs] [-m measure_secs] [-o dir] [-F]\n");
+	printf("   -n sensors       comma separated list of fleet sizes (default 1,4,16)\n");
+	printf("   -c cycles        measurement cycles run by every driver (default 2)\n");
+	printf("   -p period_secs   period of the measurement cycles (default 30)\n");
+	printf("   -m measure_secs  duration of the emulated measurement (default 2)\n");
+	printf("   -o dir           directory for the driver logs and metrics (default a new one in /tmp)\n");
+	printf("   -F               run the drivers in framing mode\n");
+}
+
+
+/*
+ * Entry point of the "bench" subcommand. Prints one CSV line per fleet size
+ */
+int bench_main(int argc, char** argv){
+	char sizes[256] = "1,4,16";
+	char dir[256] = "";
+	char exe[512];
+	int cycles = 2;
+	int period = 30;
+	double meas_secs = 2;
+	int framing = 0;
+	bench_result res;
+	char* tok;
+	char* save;
+	int opt;
+	ssize_t len;
+
+	optind = 1;
+	while ((opt = getopt(argc, argv, "n:c:p:m:o:Fh")) != -1) {
+		switch (opt) {
+			case 'n':
+				strncpy(sizes, optarg, sizeof(sizes) - 1);
+				break;
+			case 'c':
+				cycles = atoi(optarg);
+				break;
+			case 'p':
+				period = atoi(optarg);
+				break;
+			case 'm':
+				meas_secs = atof(optarg);
+				break;
+			case 'F':
+				framing = 1;
+				break;
+			case 'o':
+				strncpy(dir, optarg, sizeof(dir) - 1);
+				break;
+			default:
+				bench_usage();
+				return opt == 'h' ? 0 : -1;
+		}
+	}
+	if (cycles < 1) {
+		cycles = 1;
+	}
+
+	len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if (len < 0) {
+		speLOG(LOG_ERR, "bench: could not find the driver executable");
+		return -1;
+	}
+	exe[len] = 0;
+	if (dir[0] == 0) {
+		strcpy(dir, "/tmp/cws-bench-XXXXXX");
+		if (mkdtemp(dir) == NULL) {
+			speLOG(LOG_ERR, "bench: could not create a temporary directory");
+			return -1;
+		}
+	}
+	else if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		speLOG(LOG_ERR, "bench: could not create directory %s", dir);
+		return -1;
+	}
+	fprintf(stderr, "driver logs and metrics in %s\n", dir);
+
+	printf("sensors,wall_s,cpu_ms_per_sensor_cycle,max_rss_kb,ctx_switches_per_sensor_cycle,"
+			"rtt_p50_ms,rtt_p99_ms,cycles,failed,missed,emulator_cpu_s\n");
+	for (tok = strtok_r(sizes, ",", &save) ; tok != NULL ; tok = strtok_r(NULL, ",", &save)) {
+		int n = atoi(tok);
+		if (n < 1 || n > BENCH_MAX_SENSORS) {
+			speLOG(LOG_ERR, "bench: invalid number of sensors %s", tok);
+			continue;
+		}
+		if (bench_run(n, cycles, period, meas_secs, framing, exe, dir, &res) < 0) {
+			return -1;
+		}
+		double sensor_cycles = (double)n*cycles;
+		printf("%d,%.1f,%.2f,%ld,%.1f,%.2f,%.2f,%lu,%lu,%lu,%.2f\n",
+				n, res.wall, 1000*res.cpu/sensor_cycles, res.max_rss_kb, res.ctx_switches/sensor_cycles,
+				hist_percentile(&res.rtt, 50), hist_percentile(&res.rtt, 99),
+				res.cycles, res.failed, res.missed, res.emulator_cpu);
+		fflush(stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,21 @@
+/*
+ * Fleet-scale load generator and scaling benchmark. Emulates N CWS sensors on
+ * pseudo terminal pairs (with the timing of a 9600 bauds line) and runs one
+ * driver process per sensor for a number of measurement cycles, for every N
+ * of the list. For every N it reports the CPU time, RSS and context switches
+ * of the drivers, the command round trip times and the missed deadlines.
+ *
+ * CLI usage (see bench_main):
+ *   $ ./driver bench -n 1,16,64,256 -c 3
+ */
+
+#ifndef CWS_BENCH_H
+#define CWS_BENCH_H
+
+#define BENCH_MAX_SENSORS 1024
+#define BENCH_BYTE_US 1042      // time to send a byte at 9600 bauds (8N1)
+#define BENCH_PROCESSING_MS 20  // time the emulated sensor takes to answer a command
+
+int bench_main(int argc, char** argv);
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * Checkpoint of the measurement cycle, see cws_checkpoint.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cws_checkpoint.h"
+#include "costof_simulator.h"
+
+const char* ckpt_phase_str[] = {"NONE", "INIT", "MEASURING", "SAMPLE", "CHLORINATOR", "RINSE"};
+
+static char checkpoint_path[512] = "";
+
+
+/*
+ * Writes the checkpoint to a temporary file, syncs it and renames it over the
+ * previous one, so a crash leaves either the old or the new checkpoint
+ */
+static int checkpoint_save(const cws_checkpoint* ck){
+	char tmp[520];
+	FILE* f;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", checkpoint_path);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		speLOG(LOG_ERR, "could not write checkpoint %s", checkpoint_path);
+		return -1;
+	}
+	fprintf(f, "phase %s\ncycle_start %.3f\nmeasure_start %.3f\nphase_time %.3f\nsensor_state %d\n",
+			ckpt_phase_str[ck->phase], ck->cycle_start, ck->measure_start, ck->phase_time, ck->sensor_state);
+	fflush(f);
+	fsync(fileno(f));
+	fclose(f);
+	return rename(tmp, checkpoint_path);
+}
+
+
+/*
+ * Enables checkpointing to path and loads the checkpoint left there by a
+ * previous run, if any. Returns the phase the previous run was in (CKPT_NONE
+ * if there was no cycle in progress) or -1 on error
+ */
+int checkpoint_open(const char* path, cws_checkpoint* ck){
+	char line[256];
+	char value[64];
+	FILE* f;
+	int i;
+
+	memset(ck, 0, sizeof(cws_checkpoint));
+	strncpy(checkpoint_path, path, sizeof(checkpoint_path) - 1);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		return CKPT_NONE; // first run
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "phase %63s", value) == 1) {
+			for (i = 0 ; i < CKPT_PHASES ; i++) {
+				if (!strcmp(value, ckpt_phase_str[i])) {
+					ck->phase = i;
+				}
+			}
+		}
+		sscanf(line, "cycle_start %lf", &ck->cycle_start);
+		sscanf(line, "measure_start %lf", &ck->measure_start);
+		sscanf(line, "phase_time %lf", &ck->phase_time);
+		sscanf(line, "sensor_state %d", &ck->sensor_state);
+	}
+	fclose(f);
+	return ck->phase;
+}
+
+
+/*
+ * Moves the cycle to a new phase and saves the checkpoint (if enabled)
+ */
+int checkpoint_enter(cws_checkpoint* ck, int phase, int sensor_state){
+	double now = linux_get_epoch_time();
+	if (phase == CKPT_INIT) {
+		ck->cycle_start = now;
+		ck->measure_start = 0;
+	} else if (phase == CKPT_MEASURING) {
+		ck->measure_start = now;
+	}
+	ck->phase = phase;
+	ck->phase_time = now;
+	ck->sensor_state = sensor_state;
+	if (checkpoint_path[0] == 0) {
+		return 0;
+	}
+	return checkpoint_save(ck);
+}
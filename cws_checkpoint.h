@@ -0,0 +1,34 @@
+/*
+ * Checkpoint of the measurement cycle in progress. The phase of the cycle is
+ * saved to a small file on every transition, so a driver restarted in the
+ * middle of a measurement (crash, upgrade, USB reset) can reattach to the
+ * sensor instead of stopping it and losing the analysis.
+ */
+
+#ifndef CWS_CHECKPOINT_H
+#define CWS_CHECKPOINT_H
+
+typedef enum {
+	CKPT_NONE = 0,      // no cycle in progress
+	CKPT_INIT,          // cycle started, sensor being initialized
+	CKPT_MEASURING,     // START sent, waiting for the sensor to go IDLE
+	CKPT_SAMPLE,        // measurement finished, sample not read yet
+	CKPT_CHLORINATOR,   // sample read, chlorination phase
+	CKPT_RINSE,         // rinse phase
+	CKPT_PHASES
+}ckpt_phase;
+
+extern const char* ckpt_phase_str[];
+
+typedef struct {
+	int phase;             // ckpt_phase
+	double cycle_start;    // epoch secs
+	double measure_start;  // epoch secs, when START was sent
+	double phase_time;     // epoch secs, when the phase was entered
+	int sensor_state;      // last state reported by the sensor (cws_state)
+}cws_checkpoint;
+
+int checkpoint_open(const char* path, cws_checkpoint* ck);
+int checkpoint_enter(cws_checkpoint* ck, int phase, int sensor_state);
+
+#endif
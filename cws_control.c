@@ -0,0 +1,288 @@
+/*
+ * Local control socket, see cws_control.h
+ */
+
+#define _GNU_SOURCE // accept4
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "cws_control.h"
+#include "costof_simulator.h"
+
+typedef struct {
+	int fd;          // -1 if the slot is free
+	int req;         // pending request, 0 while the command is being received
+	int len;
+	char line[CTL_LINE_SIZE];
+	double since;    // when the client connected (monotonic secs)
+}ctl_client;
+
+static int listen_fd = -1;
+static char sock_path[108];
+static ctl_client clients[CTL_MAX_CLIENTS];
+static int measure_requested = 0;
+
+
+/*
+ * Creates the control socket at path, with mode CTL_SOCKET_MODE. A socket left
+ * by a previous run is replaced, any other file is left alone. Returns 0 on
+ * success, -1 on error
+ */
+int ctl_open(const char* path){
+	struct sockaddr_un addr;
+	struct stat st;
+	int i;
+
+	for (i = 0 ; i < CTL_MAX_CLIENTS ; i++) {
+		clients[i].fd = -1;
+	}
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		speLOG(LOG_ERR, "control socket path too long");
+		return -1;
+	}
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			speLOG(LOG_ERR, "%s exists and is not a socket, not replacing it", path);
+			return -1;
+		}
+		unlink(path); // remove the socket left by a previous run
+	}
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		speLOG(LOG_ERR, "could not create control socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || chmod(path, CTL_SOCKET_MODE) < 0 ||
+			listen(listen_fd, CTL_MAX_CLIENTS) < 0) {
+		speLOG(LOG_ERR, "could not bind control socket %s", path);
+		close(listen_fd);
+		listen_fd = -1;
+		return -1;
+	}
+	strcpy(sock_path, path);
+	speLOG(LOG_INFO, "Control socket listening at %s", path);
+	return 0;
+}
+
+
+static void ctl_drop(ctl_client* c){
+	close(c->fd);
+	c->fd = -1;
+	c->req = 0;
+	c->len = 0;
+}
+
+
+static void ctl_send(ctl_client* c, const char* msg){
+	send(c->fd, msg, strlen(msg), MSG_NOSIGNAL | MSG_DONTWAIT);
+	ctl_drop(c);
+}
+
+
+/*
+ * Parses a command line received from a client
+ */
+static void ctl_parse(ctl_client* c){
+	char* cmd = c->line;
+	cmd[strcspn(cmd, "\r\n")] = 0;
+
+	if (!strcmp(cmd, "STATUS")) {
+		c->req = CTL_REQ_STATUS;
+	}
+	else if (!strcmp(cmd, "LAST")) {
+		c->req = CTL_REQ_LAST;
+	}
+	else if (!strcmp(cmd, "STATS")) {
+		c->req = CTL_REQ_STATS;
+	}
+	else if (!strcmp(cmd, "HEALTH")) {
+		c->req = CTL_REQ_HEALTH;
+	}
+	else if (!strcmp(cmd, "MEASURE")) {
+		// Triggers are merged, several MEASURE before the cycle starts run a single cycle
+		measure_requested = 1;
+		ctl_send(c, "OK measurement queued\n");
+	}
+	else {
+		ctl_send(c, "ERROR unknown command\n");
+	}
+}
+
+
+/*
+ * Drops the clients that connected more than CTL_CLIENT_TIMEOUT_MS ago and
+ * still haven't sent a whole command, so idle connections can't take all the
+ * slots. Clients waiting for an answer are kept
+ */
+static void ctl_expire(){
+	double now = linux_get_monotonic_time();
+	int i;
+	for (i = 0 ; i < CTL_MAX_CLIENTS ; i++) {
+		if (clients[i].fd >= 0 && clients[i].req == 0 && (now - clients[i].since)*1000 > CTL_CLIENT_TIMEOUT_MS) {
+			ctl_send(&clients[i], "ERROR timeout\n");
+		}
+	}
+}
+
+
+static void ctl_accept(){
+	int fd, i;
+	ctl_expire();
+	while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		for (i = 0 ; i < CTL_MAX_CLIENTS && clients[i].fd >= 0 ; i++);
+		if (i == CTL_MAX_CLIENTS) {
+			send(fd, "ERROR busy\n", 11, MSG_NOSIGNAL | MSG_DONTWAIT);
+			close(fd);
+			continue;
+		}
+		clients[i].fd = fd;
+		clients[i].req = 0;
+		clients[i].len = 0;
+		clients[i].since = linux_get_monotonic_time();
+	}
+}
+
+
+static void ctl_receive(ctl_client* c){
+	int n = read(c->fd, &c->line[c->len], CTL_LINE_SIZE - 1 - c->len);
+	if (n <= 0) {
+		if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+			ctl_drop(c); // client went away
+		}
+		return;
+	}
+	c->len += n;
+	c->line[c->len] = 0;
+	if (strchr(c->line, '\n') != NULL || c->len >= CTL_LINE_SIZE - 1) {
+		ctl_parse(c);
+	}
+}
+
+
+/*
+ * Returns the bitmask of requests waiting for an answer
+ */
+static int ctl_pending(){
+	int i;
+	int req = 0;
+	for (i = 0 ; i < CTL_MAX_CLIENTS ; i++) {
+		if (clients[i].fd >= 0) {
+			req |= clients[i].req;
+		}
+	}
+	return req;
+}
+
+
+/*
+ * Waits up to timeoutMs for control requests. Returns as soon as there is a
+ * request waiting for an answer, with the bitmask of pending requests. All the
+ * commands already received are processed in the same call, so concurrent
+ * requests are answered together. If the control socket is not open it just
+ * sleeps.
+ */
+int ctl_poll(int timeoutMs){
+	struct pollfd pfds[CTL_MAX_CLIENTS + 1];
+	ctl_client* owners[CTL_MAX_CLIENTS + 1];
+	int n = 0;
+	int i;
+
+	if (timeoutMs < 0) {
+		timeoutMs = 0;
+	}
+	if (listen_fd < 0) {
+		usleep(1000*timeoutMs);
+		return 0;
+	}
+	ctl_expire();
+	if (ctl_pending()) {
+		timeoutMs = 0;
+	}
+
+	pfds[n].fd = listen_fd;
+	pfds[n].events = POLLIN;
+	owners[n++] = NULL;
+	for (i = 0 ; i < CTL_MAX_CLIENTS ; i++) {
+		if (clients[i].fd >= 0 && clients[i].req == 0) {
+			pfds[n].fd = clients[i].fd;
+			pfds[n].events = POLLIN;
+			owners[n++] = &clients[i];
+		}
+	}
+
+	if (poll(pfds, n, timeoutMs) > 0) {
+		for (i = 1 ; i < n ; i++) {
+			if (pfds[i].revents) {
+				ctl_receive(owners[i]);
+			}
+		}
+		if (pfds[0].revents & POLLIN) {
+			ctl_accept();
+		}
+	}
+	return ctl_pending();
+}
+
+
+/*
+ * Sends the same answer to all the clients waiting for the request req and
+ * closes their connections
+ */
+int ctl_reply(int req, const char *format, ...){
+	char msg[4096];
+	va_list ap;
+	int i;
+
+	va_start(ap, format);
+	vsnprintf(msg, sizeof(msg), format, ap);
+	va_end(ap);
+
+	for (i = 0 ; i < CTL_MAX_CLIENTS ; i++) {
+		if (clients[i].fd >= 0 && clients[i].req == req) {
+			ctl_send(&clients[i], msg);
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * Returns 1 if a measurement has been requested through the control socket.
+ * If clear is set the request is consumed
+ */
+int ctl_measure_requested(int clear){
+	int r = measure_requested;
+	if (clear) {
+		measure_requested = 0;
+	}
+	return r;
+}
+
+
+void ctl_close(){
+	int i;
+	if (listen_fd < 0) {
+		return;
+	}
+	for (i = 0 ; i < CTL_MAX_CLIENTS ; i++) {
+		if (clients[i].fd >= 0) {
+			ctl_drop(&clients[i]);
+		}
+	}
+	close(listen_fd);
+	listen_fd = -1;
+	unlink(sock_path);
+}
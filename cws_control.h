@@ -0,0 +1,43 @@
+/*
+ * Local control socket. Operators and other services connect to a Unix-domain
+ * socket, send one command per line and receive the answer, then the
+ * connection is closed. Commands:
+ *
+ *    STATUS   current sensor state (cached for CTL_STATUS_TTL_MS)
+ *    LAST     last sample frame received from the sensor
+ *    MEASURE  trigger a measurement cycle as soon as possible
+ *    STATS    driver statistics
+ *    HEALTH   recent sensor health samples (CSV)
+ *
+ * The control socket is only served at safe points of the control path (see
+ * cws_idle), so it never interleaves with a serial transaction. All pending
+ * requests of the same kind are answered at once, so ten clients asking for
+ * the status at the same time generate a single GETSTATUS.
+ *
+ * Example:
+ *    $ echo STATUS | socat - UNIX-CONNECT:/run/cws.sock
+ */
+
+#ifndef CWS_CONTROL_H
+#define CWS_CONTROL_H
+
+#define CTL_MAX_CLIENTS 16
+#define CTL_STATUS_TTL_MS 2000   // max age of a cached status
+#define CTL_LINE_SIZE 64
+#define CTL_CLIENT_TIMEOUT_MS 5000 // clients that don't send a whole command in this time are dropped
+#define CTL_SOCKET_MODE 0660     // owner and group of the driver can connect
+
+// Requests, used as a bitmask
+#define CTL_REQ_STATUS  0x01
+#define CTL_REQ_LAST    0x02
+#define CTL_REQ_MEASURE 0x04
+#define CTL_REQ_STATS   0x08
+#define CTL_REQ_HEALTH  0x10
+
+int ctl_open(const char* path);
+int ctl_poll(int timeoutMs);
+int ctl_reply(int req, const char *format, ...);
+int ctl_measure_requested(int clear);
+void ctl_close();
+
+#endif
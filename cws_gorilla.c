@@ -0,0 +1,260 @@
+/*
+ * Gorilla-style compression of sample records, see cws_gorilla.h
+ */
+
+#include <string.h>
+
+#include "cws_gorilla.h"
+
+
+/*
+ * Appends the nbits least significant bits of value to the stream, most
+ * significant bit first. The buffer must be zeroed beforehand
+ */
+static inline void gorilla_put(gorilla_stream* s, uint64_t value, int nbits){
+	while (nbits > 0) {
+		uint32_t byte = s->bits >> 3;
+		int free_bits = 8 - (s->bits & 7);
+		int n = (nbits < free_bits) ? nbits : free_bits;
+		uint8_t chunk = (value >> (nbits - n)) & ((1u << n) - 1);
+		s->buff[byte] |= chunk << (free_bits - n);
+		s->bits += n;
+		nbits -= n;
+	}
+}
+
+
+/*
+ * Reads nbits from the stream at *pos
+ */
+static inline uint64_t gorilla_get(const gorilla_stream* s, uint32_t* pos, int nbits){
+	uint64_t value = 0;
+	while (nbits > 0) {
+		uint32_t byte = *pos >> 3;
+		int avail = 8 - (*pos & 7);
+		int n = (nbits < avail) ? nbits : avail;
+		uint8_t chunk = (s->buff[byte] >> (avail - n)) & ((1u << n) - 1);
+		value = (value << n) | chunk;
+		*pos += n;
+		nbits -= n;
+	}
+	return value;
+}
+
+
+static inline uint64_t gorilla_double_bits(double d){
+	uint64_t u;
+	memcpy(&u, &d, sizeof(u));
+	return u;
+}
+
+
+static inline double gorilla_bits_double(uint64_t u){
+	double d;
+	memcpy(&d, &u, sizeof(d));
+	return d;
+}
+
+
+static inline uint64_t gorilla_sign_extend(uint64_t value, int nbits){
+	uint64_t sign = 1ULL << (nbits - 1);
+	return (value ^ sign) - sign;
+}
+
+
+void gorilla_init(gorilla_state* st){
+	memset(st, 0, sizeof(gorilla_state));
+}
+
+
+/*
+ * Timestamp delta-of-delta:
+ *   '0'                        dod == 0
+ *   '10'   + 7 bits            dod in [-64, 63]
+ *   '110'  + 9 bits            dod in [-256, 255]
+ *   '1110' + 12 bits           dod in [-2048, 2047]
+ *   '1111' + 64 bits           otherwise
+ */
+static void gorilla_put_timestamp(gorilla_state* st, gorilla_stream* s, int64_t ts){
+	int64_t delta = ts - st->ts;
+	int64_t dod = delta - st->delta;
+
+	if (dod == 0) {
+		gorilla_put(s, 0, 1);
+	} else if (dod >= -64 && dod <= 63) {
+		gorilla_put(s, 0x2, 2);
+		gorilla_put(s, (uint64_t)dod, 7);
+	} else if (dod >= -256 && dod <= 255) {
+		gorilla_put(s, 0x6, 3);
+		gorilla_put(s, (uint64_t)dod, 9);
+	} else if (dod >= -2048 && dod <= 2047) {
+		gorilla_put(s, 0xe, 4);
+		gorilla_put(s, (uint64_t)dod, 12);
+	} else {
+		gorilla_put(s, 0xf, 4);
+		gorilla_put(s, (uint64_t)dod, 64);
+	}
+	st->delta = delta;
+	st->ts = ts;
+}
+
+
+static int64_t gorilla_get_timestamp(gorilla_state* st, const gorilla_stream* s, uint32_t* pos){
+	int64_t dod;
+	int nbits;
+
+	if (gorilla_get(s, pos, 1) == 0) {
+		dod = 0;
+	} else {
+		if (gorilla_get(s, pos, 1) == 0) {
+			nbits = 7;
+		} else if (gorilla_get(s, pos, 1) == 0) {
+			nbits = 9;
+		} else if (gorilla_get(s, pos, 1) == 0) {
+			nbits = 12;
+		} else {
+			nbits = 64;
+		}
+		dod = (int64_t)gorilla_sign_extend(gorilla_get(s, pos, nbits), nbits);
+	}
+	st->delta += dod;
+	st->ts += st->delta;
+	return st->ts;
+}
+
+
+/*
+ * XOR with the previous value:
+ *   '0'                                           same value
+ *   '10' + meaningful bits                        fits in the previous window
+ *   '11' + 6 bits leading zeros + 6 bits length + meaningful bits
+ */
+static void gorilla_put_value(gorilla_state* st, gorilla_stream* s, int field, uint64_t value){
+	uint64_t x = value ^ st->values[field];
+	st->values[field] = value;
+
+	if (x == 0) {
+		gorilla_put(s, 0, 1);
+		return;
+	}
+	int leading = __builtin_clzll(x);
+	int trailing = __builtin_ctzll(x);
+	if (st->leading[field] + st->trailing[field] > 0 &&
+			leading >= st->leading[field] && trailing >= st->trailing[field]) {
+		int len = 64 - st->leading[field] - st->trailing[field];
+		gorilla_put(s, 0x2, 2);
+		gorilla_put(s, x >> st->trailing[field], len);
+	} else {
+		int len = 64 - leading - trailing;
+		gorilla_put(s, 0x3, 2);
+		gorilla_put(s, leading, 6);
+		gorilla_put(s, len - 1, 6); // len is in [1, 64]
+		gorilla_put(s, x >> trailing, len);
+		st->leading[field] = leading;
+		st->trailing[field] = trailing;
+	}
+}
+
+
+static uint64_t gorilla_get_value(gorilla_state* st, const gorilla_stream* s, uint32_t* pos, int field){
+	uint64_t x;
+	if (gorilla_get(s, pos, 1) == 0) {
+		return st->values[field];
+	}
+	if (gorilla_get(s, pos, 1) == 0) {
+		int len = 64 - st->leading[field] - st->trailing[field];
+		x = gorilla_get(s, pos, len) << st->trailing[field];
+	} else {
+		int leading = gorilla_get(s, pos, 6);
+		int len = gorilla_get(s, pos, 6) + 1;
+		int trailing = 64 - leading - len;
+		x = gorilla_get(s, pos, len) << trailing;
+		st->leading[field] = leading;
+		st->trailing[field] = trailing;
+	}
+	st->values[field] ^= x;
+	return st->values[field];
+}
+
+
+/*
+ * Appends a record to the stream. The first record of a stream is stored raw.
+ * Returns -1 if the stream has no room for a worst case record
+ */
+int gorilla_encode(gorilla_state* st, gorilla_stream* out, const cws_record* rec){
+	uint64_t values[GORILLA_FIELDS];
+	int i;
+
+	if (out->bits + GORILLA_MAX_RECORD_BITS > 8*out->capacity) {
+		return -1;
+	}
+	values[0] = gorilla_double_bits(rec->ph);
+	values[1] = gorilla_double_bits(rec->water_temp);
+	values[2] = gorilla_double_bits(rec->voltage);
+	values[3] = gorilla_double_bits(rec->internal_temp);
+
+	if (st->count == 0) {
+		gorilla_put(out, (uint64_t)rec->timestamp, 64);
+		gorilla_put(out, rec->valid, 8);
+		for (i = 0 ; i < GORILLA_FIELDS ; i++) {
+			gorilla_put(out, values[i], 64);
+			st->values[i] = values[i];
+		}
+		st->ts = rec->timestamp;
+		st->delta = 0;
+		st->valid = rec->valid;
+		st->count++;
+		return 0;
+	}
+
+	gorilla_put_timestamp(st, out, rec->timestamp);
+	if (rec->valid == st->valid) {
+		gorilla_put(out, 0, 1);
+	} else {
+		gorilla_put(out, 1, 1);
+		gorilla_put(out, rec->valid, 8);
+		st->valid = rec->valid;
+	}
+	for (i = 0 ; i < GORILLA_FIELDS ; i++) {
+		gorilla_put_value(st, out, i, values[i]);
+	}
+	st->count++;
+	return 0;
+}
+
+
+/*
+ * Decodes the record at *pos, advancing it. The sensor field is not part of
+ * the stream and is left untouched. Returns -1 at the end of the stream
+ */
+int gorilla_decode(gorilla_state* st, const gorilla_stream* in, uint32_t* pos, cws_record* rec){
+	int i;
+	if (*pos >= in->bits) {
+		return -1;
+	}
+	if (st->count == 0) {
+		st->ts = (int64_t)gorilla_get(in, pos, 64);
+		st->delta = 0;
+		st->valid = gorilla_get(in, pos, 8);
+		for (i = 0 ; i < GORILLA_FIELDS ; i++) {
+			st->values[i] = gorilla_get(in, pos, 64);
+		}
+	} else {
+		gorilla_get_timestamp(st, in, pos);
+		if (gorilla_get(in, pos, 1)) {
+			st->valid = gorilla_get(in, pos, 8);
+		}
+		for (i = 0 ; i < GORILLA_FIELDS ; i++) {
+			gorilla_get_value(st, in, pos, i);
+		}
+	}
+	st->count++;
+
+	rec->timestamp = st->ts;
+	rec->valid = st->valid;
+	rec->ph = gorilla_bits_double(st->values[0]);
+	rec->water_temp = gorilla_bits_double(st->values[1]);
+	rec->voltage = gorilla_bits_double(st->values[2]);
+	rec->internal_temp = gorilla_bits_double(st->values[3]);
+	return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Gorilla-style compression of sample records (Pelkonen et al., "Gorilla: A
+ * Fast, Scalable, In-Memory Time Series Database"). Timestamps are stored as
+ * delta-of-delta, the floating point fields as the XOR with the previous value
+ * of the same field and the validity code only when it changes.
+ *
+ * The encoder and the decoder share the same state structure and update it in
+ * the same way, so an encoder can be resumed by decoding a partial block.
+ */
+
+#ifndef CWS_GORILLA_H
+#define CWS_GORILLA_H
+
+#include <stdint.h>
+#include "cws_history.h"
+
+#define GORILLA_FIELDS 4              // ph, water_temp, voltage, internal_temp
+#define GORILLA_MAX_RECORD_BITS 400   // worst case size of an encoded record (389 bits)
+
+typedef struct {
+	int count;                        // records encoded/decoded so far
+	int64_t ts;                       // previous timestamp
+	int64_t delta;                    // previous timestamp delta
+	uint64_t values[GORILLA_FIELDS];  // previous values, as raw bits
+	int leading[GORILLA_FIELDS];      // meaningful bits window of the previous XOR
+	int trailing[GORILLA_FIELDS];
+	uint8_t valid;
+}gorilla_state;
+
+typedef struct {
+	uint8_t* buff;
+	uint32_t capacity;  // size of buff in bytes
+	uint32_t bits;      // bits written
+}gorilla_stream;
+
+void gorilla_init(gorilla_state* st);
+int gorilla_encode(gorilla_state* st, gorilla_stream* out, const cws_record* rec);
+int gorilla_decode(gorilla_state* st, const gorilla_stream* in, uint32_t* pos, cws_record* rec);
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Sensor health telemetry, see cws_health.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cws_health.h"
+#include "costof_simulator.h"
+
+#define HEALTH_CSV_HEADER "time,clock_offset,voltage,internal_temp,error,state\n"
+
+static FILE* health_log = NULL;
+
+
+/*
+ * Appends every health sample to a CSV file from now on
+ */
+int health_open_log(const char* path){
+	health_log = fopen(path, "a");
+	if (health_log == NULL) {
+		speLOG(LOG_ERR, "could not open health log %s", path);
+		return -1;
+	}
+	if (ftell(health_log) == 0) {
+		fputs(HEALTH_CSV_HEADER, health_log);
+	}
+	return 0;
+}
+
+
+static int health_format_sample(const health_sample* s, char* buff, int size){
+	return snprintf(buff, size, "%.3f,%.3f,%.2f,%.2f,%d,%d\n",
+			s->time, s->clock_offset, s->voltage, s->internal_temp, s->error, s->state);
+}
+
+
+void health_add(cws_health* h, const health_sample* s){
+	if (h->count == 0 || s->voltage < h->voltage_min) {
+		h->voltage_min = s->voltage;
+	}
+	if (h->count == 0 || s->voltage > h->voltage_max) {
+		h->voltage_max = s->voltage;
+	}
+	if (h->count == 0 || s->internal_temp < h->temp_min) {
+		h->temp_min = s->internal_temp;
+	}
+	if (h->count == 0 || s->internal_temp > h->temp_max) {
+		h->temp_max = s->internal_temp;
+	}
+	if (s->error != 0) {
+		h->errors++;
+	}
+	memcpy(&h->samples[h->count % HEALTH_SAMPLES], s, sizeof(health_sample));
+	h->count++;
+
+	if (health_log != NULL) {
+		char line[128];
+		health_format_sample(s, line, sizeof(line));
+		fputs(line, health_log);
+		fflush(health_log);
+	}
+}
+
+
+/*
+ * Drift of the sensor clock (ppm, positive if it runs fast), least squares
+ * slope of the offset over the samples in memory. The offsets have the 1 s
+ * resolution of the sensor clock, so 0 is returned until they span
+ * HEALTH_DRIFT_MIN_SECS
+ */
+double health_drift_ppm(const cws_health* h){
+	unsigned long n = h->count < HEALTH_SAMPLES ? h->count : HEALTH_SAMPLES;
+	unsigned long first = h->count - n;
+	unsigned long i;
+	double t0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+
+	if (n < 2) {
+		return 0;
+	}
+	t0 = h->samples[first % HEALTH_SAMPLES].time;
+	if (h->samples[(h->count - 1) % HEALTH_SAMPLES].time - t0 < HEALTH_DRIFT_MIN_SECS) {
+		return 0;
+	}
+	for (i = first ; i < h->count ; i++) {
+		const health_sample* s = &h->samples[i % HEALTH_SAMPLES];
+		double x = s->time - t0;
+		sx += x;
+		sy += s->clock_offset;
+		sxx += x*x;
+		sxy += x*s->clock_offset;
+	}
+	double den = n*sxx - sx*sx;
+	return den > 0 ? 1e6*(n*sxy - sx*sy)/den : 0;
+}
+
+
+/*
+ * Writes the health summary as "key value" lines
+ */
+int health_format_stats(const cws_health* h, char* buff, int size){
+	const health_sample* last;
+	if (h->count == 0) {
+		return snprintf(buff, size, "health_samples 0\n");
+	}
+	last = &h->samples[(h->count - 1) % HEALTH_SAMPLES];
+	return snprintf(buff, size,
+			"health_samples %lu\nhealth_errors %lu\nhealth_last_error %d\n"
+			"health_voltage %.2f\nhealth_voltage_min %.2f\nhealth_voltage_max %.2f\n"
+			"health_internal_temp %.2f\nhealth_internal_temp_min %.2f\nhealth_internal_temp_max %.2f\n"
+			"health_clock_offset_s %.3f\nhealth_clock_drift_ppm %.2f\n",
+			h->count, h->errors, last->error,
+			last->voltage, h->voltage_min, h->voltage_max,
+			last->internal_temp, h->temp_min, h->temp_max,
+			last->clock_offset, health_drift_ppm(h));
+}
+
+
+/*
+ * Writes the last n samples (at most those in memory) as CSV
+ */
+int health_format_series(const cws_health* h, int n, char* buff, int size){
+	unsigned long first;
+	unsigned long i;
+	int len;
+
+	if ((unsigned long)n > h->count) {
+		n = h->count;
+	}
+	if (n > HEALTH_SAMPLES) {
+		n = HEALTH_SAMPLES;
+	}
+	first = h->count - n;
+	len = snprintf(buff, size, HEALTH_CSV_HEADER);
+	for (i = first ; i < h->count && len < size ; i++) {
+		len += health_format_sample(&h->samples[i % HEALTH_SAMPLES], buff + len, size - len);
+	}
+	return len;
+}
+
+
+void health_close_log(){
+	if (health_log != NULL) {
+		fclose(health_log);
+		health_log = NULL;
+	}
+}
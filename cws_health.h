@@ -0,0 +1,44 @@
+/*
+ * Sensor health telemetry. Every GETSTATUS reply already carries the sensor
+ * clock, supply voltage, internal temperature and error code, so they are
+ * kept as a time series on every status poll without any extra serial
+ * transaction. The offset between the sensor clock and the host clock is
+ * tracked too, along with its drift.
+ *
+ * The last HEALTH_SAMPLES polls are kept in memory (oldest overwritten) and
+ * can optionally be appended to a CSV file.
+ */
+
+#ifndef CWS_HEALTH_H
+#define CWS_HEALTH_H
+
+#define HEALTH_SAMPLES 1024
+#define HEALTH_DRIFT_MIN_SECS 600  // time span needed to estimate the clock drift
+
+typedef struct {
+	double time;          // host epoch secs
+	double clock_offset;  // sensor clock - host clock (secs)
+	float voltage;
+	float internal_temp;
+	int error;            // error code reported by the sensor
+	int state;            // state reported by the sensor (cws_state)
+}health_sample;
+
+typedef struct {
+	health_sample samples[HEALTH_SAMPLES];
+	unsigned long count;   // total samples, the ring index is count % HEALTH_SAMPLES
+	unsigned long errors;  // polls with a non zero error code
+	float voltage_min;
+	float voltage_max;
+	float temp_min;
+	float temp_max;
+}cws_health;
+
+int health_open_log(const char* path);
+void health_add(cws_health* h, const health_sample* s);
+double health_drift_ppm(const cws_health* h);
+int health_format_stats(const cws_health* h, char* buff, int size);
+int health_format_series(const cws_health* h, int n, char* buff, int size);
+void health_close_log();
+
+#endif
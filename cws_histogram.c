@@ -0,0 +1,99 @@
+/*
+ * Latency histogram, see cws_histogram.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "cws_histogram.h"
+
+
+static int hist_bucket(double ms){
+	double us = ms*1000;
+	if (us < 1) {
+		return 0;
+	}
+	int b = (int)(log2(us)*HIST_SUB_BUCKETS);
+	return (b < HIST_BUCKETS) ? b : HIST_BUCKETS - 1;
+}
+
+
+/*
+ * Upper bound of a bucket, in milliseconds
+ */
+static double hist_bucket_ms(int b){
+	return pow(2.0, ((double)(b + 1))/HIST_SUB_BUCKETS)/1000;
+}
+
+
+void hist_add(cws_histogram* h, double ms){
+	h->buckets[hist_bucket(ms)]++;
+	h->count++;
+	h->sum_ms += ms;
+	if (ms > h->max_ms) {
+		h->max_ms = ms;
+	}
+}
+
+
+/*
+ * Returns the value (ms) below which p percent of the samples fall
+ */
+double hist_percentile(const cws_histogram* h, double p){
+	unsigned long target = (unsigned long)ceil(h->count*p/100);
+	unsigned long acc = 0;
+	int b;
+	if (h->count == 0) {
+		return 0;
+	}
+	for (b = 0 ; b < HIST_BUCKETS ; b++) {
+		acc += h->buckets[b];
+		if (acc >= target && acc > 0) {
+			double v = hist_bucket_ms(b);
+			return (v < h->max_ms) ? v : h->max_ms;
+		}
+	}
+	return h->max_ms;
+}
+
+
+/*
+ * Writes the non empty buckets as "index:count" pairs separated by spaces
+ */
+int hist_format(const cws_histogram* h, char* buff, int size){
+	int n = 0;
+	int b;
+	buff[0] = 0;
+	for (b = 0 ; b < HIST_BUCKETS && n < size ; b++) {
+		if (h->buckets[b] > 0) {
+			n += snprintf(buff + n, size - n, "%s%d:%lu", n > 0 ? " " : "", b, h->buckets[b]);
+		}
+	}
+	return n;
+}
+
+
+/*
+ * Adds the buckets written by hist_format to h. The sum and max are
+ * approximated from the bucket bounds
+ */
+int hist_parse(cws_histogram* h, const char* str){
+	int b;
+	unsigned long count;
+	int consumed;
+	while (sscanf(str, " %d:%lu%n", &b, &count, &consumed) == 2) {
+		if (b >= 0 && b < HIST_BUCKETS) {
+			double ms = hist_bucket_ms(b);
+			h->buckets[b] += count;
+			h->count += count;
+			h->sum_ms += count*ms;
+			if (ms > h->max_ms) {
+				h->max_ms = ms;
+			}
+		}
+		str += consumed;
+	}
+	return 0;
+}
@@ -0,0 +1,25 @@
+/*
+ * Latency histogram with logarithmic buckets (4 buckets per power of two of
+ * microseconds), so percentiles are accurate to ~19% from 1 us to hours with
+ * a fixed small footprint. Histograms can be merged by adding the buckets.
+ */
+
+#ifndef CWS_HISTOGRAM_H
+#define CWS_HISTOGRAM_H
+
+#define HIST_SUB_BUCKETS 4
+#define HIST_BUCKETS (36*HIST_SUB_BUCKETS)
+
+typedef struct {
+	unsigned long count;
+	double sum_ms;
+	double max_ms;
+	unsigned long buckets[HIST_BUCKETS];
+}cws_histogram;
+
+void hist_add(cws_histogram* h, double ms);
+double hist_percentile(const cws_histogram* h, double p);
+int hist_format(const cws_histogram* h, char* buff, int size);
+int hist_parse(cws_histogram* h, const char* str);
+
+#endif
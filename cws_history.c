@@ -0,0 +1,340 @@
+/*
+ * Sample history, see cws_history.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "cws_history.h"
+#include "cws_gorilla.h"
+#include "costof_simulator.h"
+
+#define HISTORY_SCAN_RECORDS 1024 // records read at once by history_scan
+
+static int history_fd = -1;
+static int history_compressed = 0;
+
+// Open block of a compressed history file
+static off_t block_offset;
+static history_block block;
+static gorilla_state block_state;
+static uint8_t block_buff[HISTORY_BLOCK_BYTES];
+static gorilla_stream block_stream = {block_buff, HISTORY_BLOCK_BYTES, 0};
+
+
+static void history_new_block(off_t offset){
+	block_offset = offset;
+	memset(&block, 0, sizeof(block));
+	memset(block_buff, 0, sizeof(block_buff));
+	block_stream.bits = 0;
+	gorilla_init(&block_state);
+}
+
+
+/*
+ * Finds the last block of a compressed file. If it still has room it's loaded
+ * and decoded, so the encoder can carry on where it was left. A block cut by a
+ * crash (payload shorter than its header claims) is discarded
+ */
+static int history_resume(off_t size){
+	off_t offset = HISTORY_MAGIC_SIZE;
+	off_t last = -1;
+	history_block hdr;
+	history_block last_hdr;
+
+	while (offset + (off_t)sizeof(hdr) <= size) {
+		if (pread(history_fd, &hdr, sizeof(hdr), offset) != sizeof(hdr)) {
+			return -1;
+		}
+		off_t next = offset + sizeof(hdr) + (hdr.bits + 7)/8;
+		if (hdr.count == 0 || next > size || hdr.bits > 8*HISTORY_BLOCK_BYTES) {
+			break; // incomplete block, overwrite it
+		}
+		last = offset;
+		last_hdr = hdr;
+		offset = next;
+	}
+
+	if (last >= 0 && last_hdr.count < HISTORY_BLOCK_RECORDS) {
+		cws_record rec;
+		uint32_t pos = 0;
+		history_new_block(last);
+		block = last_hdr;
+		if (pread(history_fd, block_buff, (block.bits + 7)/8, last + sizeof(block)) != (block.bits + 7)/8) {
+			return -1;
+		}
+		block_stream.bits = block.bits;
+		while (gorilla_decode(&block_state, &block_stream, &pos, &rec) == 0);
+		// clear the padding bits of the last byte, they will be written again
+		if (block.bits & 7) {
+			block_buff[block.bits >> 3] &= 0xff << (8 - (block.bits & 7));
+		}
+	} else {
+		history_new_block(offset);
+	}
+	return 0;
+}
+
+
+/*
+ * Opens (or creates) the history file where the samples will be appended
+ */
+int history_open(const char* path){
+	struct stat st;
+	char magic[HISTORY_MAGIC_SIZE];
+
+	history_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (history_fd < 0) {
+		speLOG(LOG_ERR, "could not open history file %s", path);
+		return -1;
+	}
+	fstat(history_fd, &st);
+	if (st.st_size == 0) {
+		if (write(history_fd, HISTORY_MAGIC_BLOCKS, HISTORY_MAGIC_SIZE) != HISTORY_MAGIC_SIZE) {
+			speLOG(LOG_ERR, "could not write history file %s", path);
+			history_close();
+			return -1;
+		}
+		history_compressed = 1;
+		history_new_block(HISTORY_MAGIC_SIZE);
+		return 0;
+	}
+	if (pread(history_fd, magic, HISTORY_MAGIC_SIZE, 0) == HISTORY_MAGIC_SIZE) {
+		if (!memcmp(magic, HISTORY_MAGIC_RAW, HISTORY_MAGIC_SIZE)) {
+			history_compressed = 0;
+			return 0;
+		}
+		if (!memcmp(magic, HISTORY_MAGIC_BLOCKS, HISTORY_MAGIC_SIZE)) {
+			history_compressed = 1;
+			if (history_resume(st.st_size) < 0) {
+				speLOG(LOG_ERR, "could not read history file %s", path);
+				history_close();
+				return -1;
+			}
+			return 0;
+		}
+	}
+	speLOG(LOG_ERR, "%s is not a history file", path);
+	history_close();
+	return -1;
+}
+
+
+/*
+ * Appends a record to the open block. Only the bytes that changed are
+ * written, and the header is updated after the payload, so a crash leaves
+ * the block as it was before the append
+ */
+static int history_append_compressed(const cws_record* rec){
+	uint32_t first_byte;
+	uint32_t end_byte;
+
+	if (block.count > 0 && (block.sensor != rec->sensor || block.count >= HISTORY_BLOCK_RECORDS ||
+			block_stream.bits + GORILLA_MAX_RECORD_BITS > 8*HISTORY_BLOCK_BYTES)) {
+		history_new_block(block_offset + sizeof(block) + (block.bits + 7)/8);
+	}
+	first_byte = block_stream.bits >> 3;
+	if (gorilla_encode(&block_state, &block_stream, rec) < 0) {
+		return -1;
+	}
+	end_byte = (block_stream.bits + 7) >> 3;
+
+	if (block.count == 0) {
+		block.sensor = rec->sensor;
+		block.min_ts = rec->timestamp;
+		block.max_ts = rec->timestamp;
+	}
+	block.count++;
+	block.bits = block_stream.bits;
+	if (rec->timestamp < block.min_ts) {
+		block.min_ts = rec->timestamp;
+	}
+	if (rec->timestamp > block.max_ts) {
+		block.max_ts = rec->timestamp;
+	}
+
+	if (pwrite(history_fd, &block_buff[first_byte], end_byte - first_byte, block_offset + sizeof(block) + first_byte) != end_byte - first_byte ||
+			pwrite(history_fd, &block, sizeof(block), block_offset) != sizeof(block)) {
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * Appends a record to the history file
+ */
+int history_append(const cws_record* rec){
+	if (history_fd < 0) {
+		return 0;
+	}
+	if (history_compressed) {
+		if (history_append_compressed(rec) < 0) {
+			speLOG(LOG_ERR, "could not append sample to history");
+			return -1;
+		}
+		return 0;
+	}
+	// raw records are written with a single write, so a crash never leaves half a record
+	if (lseek(history_fd, 0, SEEK_END) < 0 || write(history_fd, rec, sizeof(cws_record)) != sizeof(cws_record)) {
+		speLOG(LOG_ERR, "could not append sample to history");
+		return -1;
+	}
+	return 0;
+}
+
+
+void history_close(){
+	if (history_fd >= 0) {
+		close(history_fd);
+		history_fd = -1;
+	}
+}
+
+
+static int history_match(const cws_record* rec, uint32_t sensor, int64_t from, int64_t to){
+	return (sensor == 0 || rec->sensor == sensor) && rec->timestamp >= from && rec->timestamp < to;
+}
+
+
+/*
+ * Reads the records with index in [first, last) of a raw file
+ */
+static int history_scan_raw(FILE* f, long first, long last, uint32_t sensor, int64_t from, int64_t to, history_callback cb, void* arg){
+	cws_record* recs = fastMalloc(HISTORY_SCAN_RECORDS*sizeof(cws_record));
+	int count = 0;
+	int n, i;
+
+	if (recs == NULL) {
+		speLOG(LOG_ERR, "history: out of memory");
+		return -1;
+	}
+	if (fseek(f, HISTORY_MAGIC_SIZE + first*sizeof(cws_record), SEEK_SET) < 0) {
+		fastFree(recs);
+		return 0;
+	}
+	while (first < last && (n = fread(recs, sizeof(cws_record), last - first < HISTORY_SCAN_RECORDS ? last - first : HISTORY_SCAN_RECORDS, f)) > 0) {
+		first += n;
+		for (i = 0 ; i < n ; i++) {
+			if (!history_match(&recs[i], sensor, from, to)) {
+				continue;
+			}
+			if (cb(&recs[i], arg) < 0) {
+				fastFree(recs);
+				return count;
+			}
+			count++;
+		}
+	}
+	fastFree(recs);
+	return count;
+}
+
+
+/*
+ * Reads the compressed blocks whose header starts in [first, last) (file
+ * offsets), skipping (without reading the payload) the ones of other sensors
+ * or outside the time range. The headers before first are walked to find the
+ * block boundaries, which only costs a seek per block
+ */
+static int history_scan_blocks(FILE* f, long first, long last, uint32_t sensor, int64_t from, int64_t to, history_callback cb, void* arg){
+	uint8_t* buff = fastMalloc(HISTORY_BLOCK_BYTES);
+	gorilla_stream stream = {buff, HISTORY_BLOCK_BYTES, 0};
+	gorilla_state st;
+	history_block hdr;
+	cws_record rec;
+	long offset = HISTORY_MAGIC_SIZE;
+	int count = 0;
+
+	if (buff == NULL) {
+		speLOG(LOG_ERR, "history: out of memory");
+		return -1;
+	}
+	while (offset < last && fread(&hdr, sizeof(hdr), 1, f) == 1) {
+		uint32_t size = (hdr.bits + 7)/8;
+		uint32_t pos = 0;
+		if (size > HISTORY_BLOCK_BYTES) {
+			speLOG(LOG_ERR, "corrupted history block");
+			break;
+		}
+		if (offset < first || (sensor != 0 && hdr.sensor != sensor) || hdr.max_ts < from || hdr.min_ts >= to) {
+			if (fseek(f, size, SEEK_CUR) < 0) {
+				break;
+			}
+			offset += sizeof(hdr) + size;
+			continue;
+		}
+		if (fread(buff, 1, size, f) != size) {
+			break; // block being written or cut by a crash
+		}
+		offset += sizeof(hdr) + size;
+		stream.bits = hdr.bits;
+		gorilla_init(&st);
+		memset(&rec, 0, sizeof(rec));
+		rec.sensor = hdr.sensor;
+		while (gorilla_decode(&st, &stream, &pos, &rec) == 0) {
+			if (!history_match(&rec, sensor, from, to)) {
+				continue;
+			}
+			if (cb(&rec, arg) < 0) {
+				fastFree(buff);
+				return count;
+			}
+			count++;
+		}
+	}
+	fastFree(buff);
+	return count;
+}
+
+
+/*
+ * Reads the history file at path calling cb for every record of the sensor
+ * (0 for all sensors) with timestamp in [from, to). Returns the number of
+ * records passed to cb or -1 on error
+ */
+int history_scan(const char* path, uint32_t sensor, int64_t from, int64_t to, history_callback cb, void* arg){
+	return history_scan_part(path, 0, 1, sensor, from, to, cb, arg);
+}
+
+
+/*
+ * Like history_scan, but only reads part (0 to nparts - 1) of the file. The
+ * parts are contiguous ranges of records (raw files) or blocks (compressed
+ * files) of about the same size, so several threads can read a file at once,
+ * each with its own FILE. Records are passed to cb in file order
+ */
+int history_scan_part(const char* path, int part, int nparts, uint32_t sensor, int64_t from, int64_t to, history_callback cb, void* arg){
+	char magic[HISTORY_MAGIC_SIZE];
+	struct stat st;
+	int count = -1;
+	int known = 0;
+	FILE* f = fopen(path, "r");
+
+	if (f == NULL) {
+		speLOG(LOG_ERR, "could not open history file %s", path);
+		return -1;
+	}
+	if (fstat(fileno(f), &st) == 0 && fread(magic, 1, HISTORY_MAGIC_SIZE, f) == HISTORY_MAGIC_SIZE) {
+		if (!memcmp(magic, HISTORY_MAGIC_RAW, HISTORY_MAGIC_SIZE)) {
+			known = 1;
+			long n = (st.st_size - HISTORY_MAGIC_SIZE)/sizeof(cws_record);
+			count = history_scan_raw(f, n*part/nparts, n*(part + 1)/nparts, sensor, from, to, cb, arg);
+		}
+		else if (!memcmp(magic, HISTORY_MAGIC_BLOCKS, HISTORY_MAGIC_SIZE)) {
+			known = 1;
+			long n = st.st_size - HISTORY_MAGIC_SIZE;
+			count = history_scan_blocks(f, HISTORY_MAGIC_SIZE + n*part/nparts, HISTORY_MAGIC_SIZE + n*(part + 1)/nparts,
+					sensor, from, to, cb, arg);
+		}
+	}
+	if (!known) {
+		speLOG(LOG_ERR, "%s is not a history file", path);
+	}
+	fclose(f);
+	return count;
+}
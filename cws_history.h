@@ -0,0 +1,65 @@
+/*
+ * Sample history. Every sample received from the sensor is appended to a
+ * history file on the gateway, which can be queried later (see cws_query.h).
+ *
+ * Two file formats are supported, identified by an 8 bytes magic:
+ *
+ *  - HISTORY_MAGIC_RAW: fixed size cws_record structures in host byte order
+ *  - HISTORY_MAGIC_BLOCKS: Gorilla compressed blocks (see cws_gorilla.h) of
+ *    up to HISTORY_BLOCK_RECORDS records of a single sensor. Every block
+ *    starts with a history_block header, so readers can skip the blocks of
+ *    other sensors or out of the time range without decoding them.
+ *
+ * New files are written in the compressed format, existing files are appended
+ * in their own format.
+ */
+
+#ifndef CWS_HISTORY_H
+#define CWS_HISTORY_H
+
+#include <stdint.h>
+
+#define HISTORY_MAGIC_RAW "CWSHIST1"
+#define HISTORY_MAGIC_BLOCKS "CWSHIST2"
+#define HISTORY_MAGIC_SIZE 8
+
+#define HISTORY_BLOCK_RECORDS 256  // max records per compressed block
+#define HISTORY_BLOCK_BYTES (HISTORY_BLOCK_RECORDS*400/8) // payload capacity, worst case record is 400 bits
+
+typedef struct {
+	int64_t timestamp;     // sensor epoch
+	double ph;             // sample value
+	double water_temp;     // thermistor temperature
+	double voltage;        // supply voltage
+	double internal_temp;
+	uint32_t sensor;       // sensor serial number
+	uint8_t valid;         // validity code reported by the sensor
+	uint8_t reserved[3];
+}cws_record;
+
+/*
+ * Header of a compressed block, followed by (bits + 7)/8 bytes of payload
+ */
+typedef struct {
+	uint32_t sensor;
+	uint16_t count;        // records in the block
+	uint16_t reserved;
+	uint32_t bits;         // payload size in bits
+	uint32_t reserved2;
+	int64_t min_ts;        // time range covered by the block
+	int64_t max_ts;
+}history_block;
+
+/*
+ * Called for every record found by history_scan, returning a negative value
+ * stops the scan
+ */
+typedef int (*history_callback)(const cws_record* rec, void* arg);
+
+int history_open(const char* path);
+int history_append(const cws_record* rec);
+void history_close();
+int history_scan(const char* path, uint32_t sensor, int64_t from, int64_t to, history_callback cb, void* arg);
+int history_scan_part(const char* path, int part, int nparts, uint32_t sensor, int64_t from, int64_t to, history_callback cb, void* arg);
+
+#endif
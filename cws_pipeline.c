@@ -0,0 +1,224 @@
+/*
+ * Sample post-processing pipeline, see cws_pipeline.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "cws_pipeline.h"
+#include "costof_simulator.h"
+
+static char slots[PIPELINE_SLOTS][PIPELINE_FRAME_SIZE];
+static int free_slots[PIPELINE_SLOTS];   // stack of free slot indexes
+static int nfree = 0;
+static int ready[PIPELINE_SLOTS];        // FIFO of slots waiting for the worker
+static int ready_head = 0;
+static int ready_count = 0;
+static int stopping = 0;
+static int running = 0;
+
+static pipeline_handler handler_func;
+static void* handler_arg;
+static pipeline_stats stats;
+
+static pthread_t worker;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond;  // a frame was submitted (or stopping)
+static pthread_cond_t free_cond;   // a slot was released
+static pthread_cond_t done_cond;   // a frame was processed
+
+
+static int slot_index(char* frame){
+	return (frame - &slots[0][0])/PIPELINE_FRAME_SIZE;
+}
+
+
+/*
+ * Returns a slot to the free list, lock must be held
+ */
+static void pipeline_put_free(int i){
+	free_slots[nfree++] = i;
+	stats.depth--;
+	pthread_cond_signal(&free_cond);
+}
+
+
+static void* pipeline_worker(void* arg){
+	// output is not time critical, don't compete with the serial I/O in real-time mode
+	struct sched_param sp;
+	memset(&sp, 0, sizeof(sp));
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &sp);
+
+	pthread_mutex_lock(&lock);
+	while (1) {
+		while (ready_count == 0 && !stopping) {
+			pthread_cond_wait(&ready_cond, &lock);
+		}
+		if (ready_count == 0) {
+			break; // stopping and everything processed
+		}
+		int i = ready[ready_head];
+		ready_head = (ready_head + 1) % PIPELINE_SLOTS;
+		ready_count--;
+		pthread_mutex_unlock(&lock);
+
+		handler_func(slots[i], handler_arg);
+
+		pthread_mutex_lock(&lock);
+		stats.processed++;
+		pthread_cond_broadcast(&done_cond);
+		pipeline_put_free(i);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+
+/*
+ * Starts the worker thread, every submitted frame is passed to handler
+ */
+int pipeline_open(pipeline_handler handler, void* arg){
+	pthread_condattr_t attr;
+	pthread_attr_t thread_attr;
+	int i;
+	int r;
+
+	handler_func = handler;
+	handler_arg = arg;
+	for (i = 0 ; i < PIPELINE_SLOTS ; i++) {
+		free_slots[i] = i;
+	}
+	nfree = PIPELINE_SLOTS;
+	memset(&stats, 0, sizeof(stats));
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // deadlines are monotonic
+	pthread_cond_init(&ready_cond, &attr);
+	pthread_cond_init(&free_cond, &attr);
+	pthread_cond_init(&done_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	stopping = 0;
+	// a small stack, with mlockall(MCL_FUTURE) the default one (8 MB) would be
+	// locked and could exceed RLIMIT_MEMLOCK
+	pthread_attr_init(&thread_attr);
+	pthread_attr_setstacksize(&thread_attr, PIPELINE_STACK_SIZE);
+	r = pthread_create(&worker, &thread_attr, pipeline_worker, NULL);
+	pthread_attr_destroy(&thread_attr);
+	if (r != 0) {
+		speLOG(LOG_ERR, "could not start the sample pipeline worker: %s", strerror(r));
+		return -1;
+	}
+	running = 1;
+	return 0;
+}
+
+
+/*
+ * Gets a free slot to read a frame into (PIPELINE_FRAME_SIZE bytes). If all
+ * slots are in use waits until one is released or the deadline (monotonic
+ * secs) expires. Returns NULL on timeout or if the pipeline is not running
+ */
+char* pipeline_acquire(double deadline){
+	struct timespec ts;
+	char* frame = NULL;
+
+	if (!running) {
+		return NULL;
+	}
+	ts.tv_sec = (time_t)deadline;
+	ts.tv_nsec = (long)((deadline - ts.tv_sec)*1e9);
+	pthread_mutex_lock(&lock);
+	if (nfree == 0) {
+		stats.waits++;
+	}
+	while (nfree == 0) {
+		if (pthread_cond_timedwait(&free_cond, &lock, &ts) != 0 && nfree == 0) {
+			stats.timeouts++;
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+	}
+	frame = slots[free_slots[--nfree]];
+	stats.depth++;
+	if (stats.depth > stats.depth_max) {
+		stats.depth_max = stats.depth;
+	}
+	pthread_mutex_unlock(&lock);
+	return frame;
+}
+
+
+/*
+ * Hands a frame filled by the caller to the worker. The slot belongs to the
+ * pipeline from now on
+ */
+void pipeline_submit(char* frame){
+	pthread_mutex_lock(&lock);
+	ready[(ready_head + ready_count) % PIPELINE_SLOTS] = slot_index(frame);
+	ready_count++;
+	stats.submitted++;
+	pthread_cond_signal(&ready_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * Gives back a slot without submitting it (e.g. the frame could not be read)
+ */
+void pipeline_release(char* frame){
+	pthread_mutex_lock(&lock);
+	pipeline_put_free(slot_index(frame));
+	pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * Waits until all the frames submitted so far have been processed or the
+ * deadline (monotonic secs) expires. Returns 0 when they are done, -1 on
+ * timeout
+ */
+int pipeline_drain(double deadline){
+	struct timespec ts;
+	int ret = 0;
+
+	if (!running) {
+		return 0;
+	}
+	ts.tv_sec = (time_t)deadline;
+	ts.tv_nsec = (long)((deadline - ts.tv_sec)*1e9);
+	pthread_mutex_lock(&lock);
+	while (stats.processed < stats.submitted) {
+		if (pthread_cond_timedwait(&done_cond, &lock, &ts) != 0 && stats.processed < stats.submitted) {
+			ret = -1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+
+void pipeline_get_stats(pipeline_stats* st){
+	pthread_mutex_lock(&lock);
+	memcpy(st, &stats, sizeof(pipeline_stats));
+	pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * Processes the frames still in the queue and stops the worker
+ */
+void pipeline_close(){
+	if (!running) {
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_signal(&ready_cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(worker, NULL);
+	running = 0;
+}
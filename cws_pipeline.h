@@ -0,0 +1,36 @@
+/*
+ * Sample post-processing pipeline. The control path reads sample frames
+ * straight into preallocated slots and hands them to a worker thread, which
+ * parses, validates, logs and stores them, so the next command to the sensor
+ * is not delayed by the output. Slots are handed over by pointer, never
+ * copied. The queue is bounded: when all the slots are in use the producer
+ * waits (up to its deadline) for the worker to free one.
+ */
+
+#ifndef CWS_PIPELINE_H
+#define CWS_PIPELINE_H
+
+#define PIPELINE_SLOTS 8
+#define PIPELINE_FRAME_SIZE 256
+#define PIPELINE_STACK_SIZE (128*1024) // worker stack, locked in memory in real-time mode
+
+typedef void (*pipeline_handler)(char* frame, void* arg);
+
+typedef struct {
+	int depth;                // frames waiting or being processed
+	int depth_max;
+	unsigned long submitted;
+	unsigned long processed;
+	unsigned long waits;      // times the producer had to wait for a free slot
+	unsigned long timeouts;   // times no slot was freed before the deadline
+}pipeline_stats;
+
+int pipeline_open(pipeline_handler handler, void* arg);
+char* pipeline_acquire(double deadline);
+void pipeline_submit(char* frame);
+void pipeline_release(char* frame);
+int pipeline_drain(double deadline);
+void pipeline_get_stats(pipeline_stats* stats);
+void pipeline_close();
+
+#endif
@@ -0,0 +1,634 @@
+/*
+ * Downsampling and range queries over the sample history, see cws_query.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "cws_query.h"
+#include "cws_history.h"
+#include "costof_simulator.h"
+
+const char* query_field_str[] = {"ph", "water_temp", "voltage", "internal_temp"};
+
+/*
+ * Vectors of 4 doubles / 4 int64. With GCC vector extensions the compiler
+ * emits the SIMD instructions of the target (SSE/AVX, NEON...) so the same
+ * code runs on the gateways and on the servers
+ */
+typedef double v4d __attribute__ ((vector_size (32)));
+typedef int64_t v4l __attribute__ ((vector_size (32)));
+
+
+typedef struct {
+	uint32_t sensor;
+	int64_t from;
+	int64_t to;
+	query_field field;
+	query_series* series;
+	int nseries;
+	int error;         // set if the records could not be stored
+}query_loader;
+
+/*
+ * Scan of a part of a history file, every part is loaded into its own series
+ * by one of the workers and merged afterwards
+ */
+typedef struct {
+	const char* file;
+	int part;
+	int nparts;
+	query_loader loader;
+	int ret;
+}query_scan;
+
+typedef struct {
+	query_scan* scans;
+	int nscans;
+	int next;          // next scan to be done, shared by all workers
+}query_load_job;
+
+typedef struct {
+	query_series* series;
+	int nseries;
+	int next;          // next series to be processed, shared by all workers
+	int64_t bucket_secs;
+	int error;         // set if a series could not be aggregated
+}query_job;
+
+
+/*
+ * Makes room for cap samples in the columns of a series. On failure the
+ * series is left as it was
+ */
+static int query_series_grow(query_series* s, int cap){
+	int64_t* ts;
+	double* value;
+	int64_t* mask;
+
+	ts = realloc(s->ts, cap*sizeof(int64_t));
+	if (ts == NULL) {
+		return -1;
+	}
+	s->ts = ts;
+	value = realloc(s->value, cap*sizeof(double));
+	if (value == NULL) {
+		return -1;
+	}
+	s->value = value;
+	mask = realloc(s->mask, cap*sizeof(int64_t));
+	if (mask == NULL) {
+		return -1;
+	}
+	s->mask = mask;
+	s->cap = cap;
+	return 0;
+}
+
+
+/*
+ * Adds a record to the columns of its sensor
+ */
+static int query_load_record(const cws_record* rec, void* arg){
+	query_loader* l = (query_loader*)arg;
+	query_series* s = NULL;
+	double value;
+	int i;
+
+	for (i = l->nseries - 1 ; i >= 0 ; i--) {
+		if (l->series[i].sensor == rec->sensor) {
+			s = &l->series[i];
+			break;
+		}
+	}
+	if (s == NULL) {
+		query_series* series = realloc(l->series, (l->nseries + 1)*sizeof(query_series));
+		if (series == NULL) {
+			speLOG(LOG_ERR, "query: out of memory");
+			l->error = 1;
+			return -1;
+		}
+		l->series = series;
+		s = &l->series[l->nseries++];
+		memset(s, 0, sizeof(query_series));
+		s->sensor = rec->sensor;
+	}
+	if (s->n == s->cap && query_series_grow(s, (s->cap > 0) ? 2*s->cap : 1024) < 0) {
+		speLOG(LOG_ERR, "query: out of memory");
+		l->error = 1;
+		return -1;
+	}
+	switch (l->field) {
+		case QUERY_WATER_TEMP:
+			value = rec->water_temp;
+			break;
+		case QUERY_VOLTAGE:
+			value = rec->voltage;
+			break;
+		case QUERY_INTERNAL_TEMP:
+			value = rec->internal_temp;
+			break;
+		default:
+			value = rec->ph;
+			break;
+	}
+	s->ts[s->n] = rec->timestamp;
+	s->value[s->n] = value;
+	s->mask[s->n] = (rec->valid && !isnan(value)) ? -1 : 0;
+	s->n++;
+	return 0;
+}
+
+
+typedef struct {
+	int64_t ts;
+	double value;
+	int64_t mask;
+}query_row;
+
+static int query_row_cmp(const void* a, const void* b){
+	int64_t ta = ((const query_row*)a)->ts;
+	int64_t tb = ((const query_row*)b)->ts;
+	return (ta > tb) - (ta < tb);
+}
+
+/*
+ * Sorts the columns of a series by timestamp. History files are written in
+ * order, so this is only needed when several files overlap. Returns -1 if
+ * there is no memory to sort
+ */
+static int query_sort(query_series* s){
+	query_row* rows;
+	int i;
+	for (i = 1 ; i < s->n && s->ts[i - 1] <= s->ts[i] ; i++);
+	if (i >= s->n) {
+		return 0; // already sorted
+	}
+	rows = fastMalloc(s->n*sizeof(query_row));
+	if (rows == NULL) {
+		speLOG(LOG_ERR, "query: out of memory");
+		return -1;
+	}
+	for (i = 0 ; i < s->n ; i++) {
+		rows[i].ts = s->ts[i];
+		rows[i].value = s->value[i];
+		rows[i].mask = s->mask[i];
+	}
+	qsort(rows, s->n, sizeof(query_row), query_row_cmp);
+	for (i = 0 ; i < s->n ; i++) {
+		s->ts[i] = rows[i].ts;
+		s->value[i] = rows[i].value;
+		s->mask[i] = rows[i].mask;
+	}
+	fastFree(rows);
+	return 0;
+}
+
+
+static void* query_load_worker(void* arg){
+	query_load_job* job = (query_load_job*)arg;
+	int i;
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nscans) {
+		query_scan* sc = &job->scans[i];
+		sc->ret = history_scan_part(sc->file, sc->part, sc->nparts, sc->loader.sensor, sc->loader.from, sc->loader.to,
+				query_load_record, &sc->loader);
+	}
+	return NULL;
+}
+
+
+/*
+ * Appends the series loaded by a scan to the ones of the same sensor in l,
+ * the scans are merged in file order. New sensors take the columns of the
+ * scan, the rest are left to be freed by the caller
+ */
+static int query_merge(query_loader* l, query_loader* part){
+	int i, j;
+	for (i = 0 ; i < part->nseries ; i++) {
+		query_series* src = &part->series[i];
+		query_series* dst = NULL;
+		for (j = 0 ; j < l->nseries ; j++) {
+			if (l->series[j].sensor == src->sensor) {
+				dst = &l->series[j];
+				break;
+			}
+		}
+		if (dst == NULL) {
+			query_series* series = realloc(l->series, (l->nseries + 1)*sizeof(query_series));
+			if (series == NULL) {
+				return -1;
+			}
+			l->series = series;
+			l->series[l->nseries++] = *src; // columns moved, not copied
+			memset(src, 0, sizeof(query_series));
+			continue;
+		}
+		if (dst->n + src->n > dst->cap && query_series_grow(dst, dst->n + src->n) < 0) {
+			return -1;
+		}
+		memcpy(&dst->ts[dst->n], src->ts, src->n*sizeof(int64_t));
+		memcpy(&dst->value[dst->n], src->value, src->n*sizeof(double));
+		memcpy(&dst->mask[dst->n], src->mask, src->n*sizeof(int64_t));
+		dst->n += src->n;
+	}
+	return 0;
+}
+
+
+/*
+ * Loads the records of one sensor (0 for all) in [from, to) from the history
+ * files, using up to threads worker threads. Every file is split in parts
+ * (ranges of records or blocks) so the threads are used also when there are
+ * fewer files than threads, every part is read and decoded by one thread. The
+ * series array is allocated and must be released with query_free.
+ * Returns the number of series (one per sensor) or -1 on error
+ */
+int query_load(char** files, int nfiles, uint32_t sensor, int64_t from, int64_t to, query_field field, int threads, query_series** series){
+	pthread_t tids[QUERY_MAX_THREADS];
+	query_load_job job;
+	query_loader l;
+	int nparts;
+	int ret = 0;
+	int i, j, k;
+
+	if (threads > QUERY_MAX_THREADS) {
+		threads = QUERY_MAX_THREADS;
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+	nparts = (threads + nfiles - 1)/nfiles;
+	job.nscans = nfiles*nparts;
+	job.next = 0;
+	job.scans = fastMalloc(job.nscans*sizeof(query_scan));
+	if (job.scans == NULL) {
+		speLOG(LOG_ERR, "query: out of memory");
+		return -1;
+	}
+	memset(job.scans, 0, job.nscans*sizeof(query_scan));
+	for (i = 0, k = 0 ; i < nfiles ; i++) {
+		for (j = 0 ; j < nparts ; j++, k++) {
+			query_scan* sc = &job.scans[k];
+			sc->file = files[i];
+			sc->part = j;
+			sc->nparts = nparts;
+			sc->loader.sensor = sensor;
+			sc->loader.from = from;
+			sc->loader.to = to;
+			sc->loader.field = field;
+		}
+	}
+
+	if (threads > job.nscans) {
+		threads = job.nscans;
+	}
+	for (i = 0 ; i < threads - 1 ; i++) {
+		if (pthread_create(&tids[i], NULL, query_load_worker, &job) != 0) {
+			break;
+		}
+	}
+	query_load_worker(&job); // this thread helps as well
+	while (i-- > 0) {
+		pthread_join(tids[i], NULL);
+	}
+
+	memset(&l, 0, sizeof(l));
+	for (k = 0 ; k < job.nscans ; k++) {
+		query_scan* sc = &job.scans[k];
+		if (sc->ret < 0 || sc->loader.error) {
+			ret = -1;
+		}
+		if (ret == 0 && query_merge(&l, &sc->loader) < 0) {
+			speLOG(LOG_ERR, "query: out of memory");
+			ret = -1;
+		}
+		query_free(sc->loader.series, sc->loader.nseries);
+	}
+	fastFree(job.scans);
+	if (ret < 0) {
+		query_free(l.series, l.nseries);
+		return -1;
+	}
+	for (i = 0 ; i < l.nseries ; i++) {
+		if (query_sort(&l.series[i]) < 0) {
+			query_free(l.series, l.nseries);
+			return -1;
+		}
+	}
+	*series = l.series;
+	return l.nseries;
+}
+
+
+/*
+ * Aggregates the valid samples in value[0..n) into the bucket. Branch-free:
+ * invalid samples are masked out instead of skipped
+ */
+static void query_kernel(const double* value, const int64_t* mask, int n, query_bucket* b){
+	const v4d one = {1.0, 1.0, 1.0, 1.0};
+	const v4d inf = {INFINITY, INFINITY, INFINITY, INFINITY};
+	const v4d ninf = -inf;
+	v4d vsum = {0, 0, 0, 0};
+	v4d vcnt = {0, 0, 0, 0};
+	v4d vmin = inf;
+	v4d vmax = ninf;
+	double sum, cnt, min, max;
+	int i = 0, j;
+
+	for ( ; i + 4 <= n ; i += 4) {
+		v4d x;
+		v4l m;
+		memcpy(&x, &value[i], sizeof(x)); // unaligned load
+		memcpy(&m, &mask[i], sizeof(m));
+
+		vsum += (v4d)((v4l)x & m);
+		vcnt += (v4d)((v4l)one & m);
+		v4d xmin = (v4d)(((v4l)x & m) | ((v4l)inf & ~m));
+		v4d xmax = (v4d)(((v4l)x & m) | ((v4l)ninf & ~m));
+		v4l lt = xmin < vmin;
+		v4l gt = xmax > vmax;
+		vmin = (v4d)(((v4l)xmin & lt) | ((v4l)vmin & ~lt));
+		vmax = (v4d)(((v4l)xmax & gt) | ((v4l)vmax & ~gt));
+	}
+
+	sum = vsum[0] + vsum[1] + vsum[2] + vsum[3];
+	cnt = vcnt[0] + vcnt[1] + vcnt[2] + vcnt[3];
+	min = INFINITY;
+	max = -INFINITY;
+	for (j = 0 ; j < 4 ; j++) {
+		min = (vmin[j] < min) ? vmin[j] : min;
+		max = (vmax[j] > max) ? vmax[j] : max;
+	}
+	for ( ; i < n ; i++) {
+		if (mask[i]) {
+			sum += value[i];
+			cnt += 1;
+			min = (value[i] < min) ? value[i] : min;
+			max = (value[i] > max) ? value[i] : max;
+		}
+	}
+
+	b->total = n;
+	b->count = (int)cnt;
+	if (b->count > 0) {
+		b->mean = sum/cnt;
+		b->min = min;
+		b->max = max;
+	} else {
+		b->mean = b->min = b->max = NAN;
+	}
+}
+
+
+/*
+ * Returns the first index in ts[lo..n) with a timestamp >= t
+ */
+static int query_lower_bound(const int64_t* ts, int lo, int n, int64_t t){
+	int hi = n;
+	while (lo < hi) {
+		int mid = lo + (hi - lo)/2;
+		if (ts[mid] < t) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+
+/*
+ * Splits a series in buckets of bucket_secs (0 for a single bucket) and
+ * aggregates them. Empty buckets are not reported. Returns the number of
+ * buckets or -1 if out of memory
+ */
+static int query_aggregate(query_series* s, int64_t bucket_secs){
+	int i = 0;
+	int cap = 16;
+	s->nbuckets = 0;
+	s->buckets = malloc(cap*sizeof(query_bucket));
+	if (s->buckets == NULL) {
+		return -1;
+	}
+
+	while (i < s->n) {
+		int64_t start, end;
+		int j;
+		if (bucket_secs > 0) {
+			// floor division, also for timestamps before 1970
+			start = s->ts[i] / bucket_secs * bucket_secs;
+			if (start > s->ts[i]) {
+				start -= bucket_secs;
+			}
+			end = start + bucket_secs;
+			j = query_lower_bound(s->ts, i, s->n, end);
+		} else {
+			start = s->ts[i];
+			j = s->n;
+		}
+		if (s->nbuckets == cap) {
+			query_bucket* buckets = realloc(s->buckets, 2*cap*sizeof(query_bucket));
+			if (buckets == NULL) {
+				return -1;
+			}
+			s->buckets = buckets;
+			cap *= 2;
+		}
+		query_bucket* b = &s->buckets[s->nbuckets++];
+		b->start = start;
+		query_kernel(&s->value[i], &s->mask[i], j - i, b);
+		i = j;
+	}
+	return s->nbuckets;
+}
+
+
+static void* query_worker(void* arg){
+	query_job* job = (query_job*)arg;
+	int i;
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nseries) {
+		if (query_aggregate(&job->series[i], job->bucket_secs) < 0) {
+			__atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * Aggregates all the series using up to threads threads, the caller and
+ * threads - 1 workers (one sensor per thread at a time). The results are
+ * stored in the buckets of every series. Returns 0 or -1 if out of memory
+ */
+int query_run(query_series* series, int nseries, int64_t bucket_secs, int threads){
+	pthread_t tids[QUERY_MAX_THREADS];
+	query_job job;
+	int i;
+
+	job.series = series;
+	job.nseries = nseries;
+	job.next = 0;
+	job.bucket_secs = bucket_secs;
+	job.error = 0;
+
+	if (threads > QUERY_MAX_THREADS) {
+		threads = QUERY_MAX_THREADS;
+	}
+	if (threads > nseries) {
+		threads = nseries;
+	}
+	for (i = 0 ; i < threads - 1 ; i++) {
+		if (pthread_create(&tids[i], NULL, query_worker, &job) != 0) {
+			break;
+		}
+	}
+	query_worker(&job); // this thread helps as well
+	while (i-- > 0) {
+		pthread_join(tids[i], NULL);
+	}
+	if (job.error) {
+		speLOG(LOG_ERR, "query: out of memory");
+		return -1;
+	}
+	return 0;
+}
+
+
+void query_free(query_series* series, int nseries){
+	int i;
+	for (i = 0 ; i < nseries ; i++) {
+		free(series[i].ts);
+		free(series[i].value);
+		free(series[i].mask);
+		free(series[i].buckets);
+	}
+	free(series);
+}
+
+
+/*
+ * Parses a duration in seconds, with optional suffix s, m, h or d
+ */
+static int64_t query_parse_duration(const char* str){
+	char* end;
+	int64_t value = strtoll(str, &end, 10);
+	switch (*end) {
+		case 'm':
+			return value*60;
+		case 'h':
+			return value*3600;
+		case 'd':
+			return value*86400;
+		default:
+			return value;
+	}
+}
+
+
+static void query_usage(){
+	printf("usage: driver query [-f field] [-S sensor] [-F from] [-T to] [-b bucket] [-j threads] file...\n");
+	printf("   -f field    ph, water_temp, voltage or internal_temp (default ph)\n");
+	printf("   -S sensor   serial number of the sensor (default all)\n");
+	printf("   -F from     start of the range, epoch time (default all)\n");
+	printf("   -T to       end of the range (not included), epoch time (default all)\n");
+	printf("   -b bucket   bucket size in seconds or with suffix m, h or d, e.g. 1h (default 1h, 0 for a single bucket)\n");
+	printf("   -j threads  threads reading and aggregating, including the main one (default number of CPUs)\n");
+}
+
+
+/*
+ * Entry point of the "query" subcommand. Prints the aggregates as CSV
+ */
+int query_main(int argc, char** argv){
+	query_field field = QUERY_PH;
+	uint32_t sensor = 0;
+	int64_t from = INT64_MIN;
+	int64_t to = INT64_MAX;
+	int64_t bucket = 3600;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	query_series* series;
+	int nseries;
+	int opt, i, j;
+
+	optind = 1;
+	while ((opt = getopt(argc, argv, "f:S:F:T:b:j:h")) != -1) {
+		switch (opt) {
+			case 'f':
+				for (i = 0 ; i < QUERY_FIELDS_COUNT && strcmp(optarg, query_field_str[i]) ; i++);
+				if (i == QUERY_FIELDS_COUNT) {
+					speLOG(LOG_ERR, "unknown field %s", optarg);
+					return -1;
+				}
+				field = (query_field)i;
+				break;
+			case 'S':
+				sensor = strtoul(optarg, NULL, 10);
+				break;
+			case 'F':
+				from = strtoll(optarg, NULL, 10);
+				break;
+			case 'T':
+				to = strtoll(optarg, NULL, 10);
+				break;
+			case 'b':
+				bucket = query_parse_duration(optarg);
+				break;
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			default:
+				query_usage();
+				return opt == 'h' ? 0 : -1;
+		}
+	}
+	if (optind >= argc) {
+		query_usage();
+		return -1;
+	}
+
+	double start = linux_get_monotonic_time();
+	nseries = query_load(&argv[optind], argc - optind, sensor, from, to, field, threads, &series);
+	if (nseries < 0) {
+		return -1;
+	}
+	double loaded = linux_get_monotonic_time();
+	if (query_run(series, nseries, bucket, threads) < 0) {
+		query_free(series, nseries);
+		return -1;
+	}
+	double done = linux_get_monotonic_time();
+
+	printf("sensor,bucket,count,total,mean,min,max\n");
+	for (i = 0 ; i < nseries ; i++) {
+		for (j = 0 ; j < series[i].nbuckets ; j++) {
+			query_bucket* b = &series[i].buckets[j];
+			char date[32];
+			time_t t = (time_t)b->start;
+			struct tm tm;
+			gmtime_r(&t, &tm);
+			strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", &tm);
+			printf("%u,%s,%d,%d,%.4f,%.4f,%.4f\n", series[i].sensor, date, b->count, b->total, b->mean, b->min, b->max);
+		}
+	}
+	long total = 0;
+	long bytes = 0;
+	for (i = 0 ; i < nseries ; i++) {
+		total += series[i].n;
+	}
+	for (i = optind ; i < argc ; i++) {
+		struct stat st;
+		if (stat(argv[i], &st) == 0) {
+			bytes += st.st_size;
+		}
+	}
+	fprintf(stderr, "%ld samples from %d sensors, %ld bytes in files, load %.3f s, aggregate %.3f s\n",
+			total, nseries, bytes, loaded - start, done - loaded);
+	query_free(series, nseries);
+	return 0;
+}
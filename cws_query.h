@@ -0,0 +1,59 @@
+/*
+ * Downsampling and range queries over the sample history files. Records are
+ * loaded in a columnar layout (one array per field) grouped by sensor, and
+ * aggregated per time bucket (count of valid samples, mean, min, max) with
+ * SIMD kernels. Files are read and decoded by several threads (every file is
+ * split in ranges of records or blocks) and the buckets are aggregated by
+ * several threads across sensors.
+ *
+ * CLI usage (see query_main):
+ *   $ ./driver query -b 1h -F 1690000000 history.bin
+ */
+
+#ifndef CWS_QUERY_H
+#define CWS_QUERY_H
+
+#include <stdint.h>
+
+#define QUERY_MAX_THREADS 64
+
+typedef enum {
+	QUERY_PH = 0,
+	QUERY_WATER_TEMP,
+	QUERY_VOLTAGE,
+	QUERY_INTERNAL_TEMP,
+	QUERY_FIELDS_COUNT
+}query_field;
+
+typedef struct {
+	int64_t start;     // bucket start (epoch), aligned to the bucket size
+	int count;         // valid samples in the bucket
+	int total;         // samples in the bucket, valid or not
+	double mean;       // mean, min and max of the valid samples (NaN if none)
+	double min;
+	double max;
+}query_bucket;
+
+/*
+ * Samples of a sensor in columnar layout, sorted by timestamp
+ */
+typedef struct {
+	uint32_t sensor;
+	int n;
+	int cap;
+	int64_t* ts;
+	double* value;
+	int64_t* mask;     // all bits set if the sample is valid, 0 otherwise
+
+	query_bucket* buckets;
+	int nbuckets;
+}query_series;
+
+extern const char* query_field_str[];
+
+int query_load(char** files, int nfiles, uint32_t sensor, int64_t from, int64_t to, query_field field, int threads, query_series** series);
+int query_run(query_series* series, int nseries, int64_t bucket_secs, int threads);
+void query_free(query_series* series, int nseries);
+int query_main(int argc, char** argv);
+
+#endif
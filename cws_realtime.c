@@ -0,0 +1,117 @@
+/*
+ * Real-time mode, see cws_realtime.h
+ */
+
+#define _GNU_SOURCE // CPU_SET, sched_setaffinity
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <malloc.h>
+#include <sys/mman.h>
+
+#include "cws_realtime.h"
+#include "costof_simulator.h"
+
+cws_histogram rt_wakeup;
+
+
+/*
+ * Touches the stack so its pages are mapped before they are locked
+ */
+static int rt_prefault_stack(){
+	volatile char stack[RT_STACK_PREFAULT];
+	int i;
+	for (i = 0 ; i < RT_STACK_PREFAULT ; i += 4096) {
+		stack[i] = 0;
+	}
+	return stack[0];
+}
+
+
+/*
+ * Maps a heap pool and tells malloc to keep it, so later fastMalloc calls
+ * reuse locked pages instead of faulting new ones
+ */
+static void rt_prefault_heap(){
+	char* pool;
+	mallopt(M_TRIM_THRESHOLD, -1); // never give memory back to the kernel
+	mallopt(M_MMAP_MAX, 0);        // big blocks from the heap too, not from new mappings
+	pool = fastMalloc(RT_HEAP_PREFAULT);
+	if (pool != NULL) {
+		memset(pool, 0, RT_HEAP_PREFAULT);
+		fastFree(pool);
+	}
+}
+
+
+/*
+ * Enables the real-time mode: pins the process to cpu (if >= 0), sets the
+ * SCHED_FIFO priority and locks the memory. Steps that fail are logged and
+ * skipped. Returns the steps that succeeded (RT_PINNED | RT_FIFO | RT_LOCKED)
+ */
+int rt_enable(int cpu, int priority){
+	struct sched_param sp;
+	cpu_set_t set;
+	int done = 0;
+
+	if (cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) == 0) {
+			done |= RT_PINNED;
+		} else {
+			speLOG(LOG_WARNING, "real-time: could not pin to CPU %d: %s", cpu, strerror(errno));
+		}
+	}
+
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = priority;
+	if (sched_setscheduler(0, SCHED_FIFO, &sp) == 0) {
+		done |= RT_FIFO;
+	} else if (errno == EPERM) {
+		speLOG(LOG_WARNING, "real-time: no privilege for SCHED_FIFO (needs CAP_SYS_NICE or an rtprio limit), using normal scheduling");
+	} else {
+		speLOG(LOG_WARNING, "real-time: could not set SCHED_FIFO priority %d: %s", priority, strerror(errno));
+	}
+
+	rt_prefault_heap();
+	rt_prefault_stack();
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+		done |= RT_LOCKED;
+	} else {
+		speLOG(LOG_WARNING, "real-time: could not lock memory (needs CAP_IPC_LOCK or a memlock limit): %s", strerror(errno));
+	}
+
+	speLOG(LOG_INFO, "real-time mode: pinned %s, SCHED_FIFO %s, memory locked %s",
+			(done & RT_PINNED) ? "yes" : "no", (done & RT_FIFO) ? "yes" : "no", (done & RT_LOCKED) ? "yes" : "no");
+	return done;
+}
+
+
+/*
+ * Measures the wakeup latency: sleeps RT_PROBE_SAMPLES periods until absolute
+ * times and adds how late every wakeup was (ms) to h
+ */
+int rt_probe_latency(cws_histogram* h){
+	struct timespec next;
+	struct timespec now;
+	int i;
+
+	memset(h, 0, sizeof(cws_histogram));
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (i = 0 ; i < RT_PROBE_SAMPLES ; i++) {
+		next.tv_nsec += RT_PROBE_PERIOD_US*1000;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		hist_add(h, (now.tv_sec - next.tv_sec)*1e3 + (now.tv_nsec - next.tv_nsec)/1e6);
+	}
+	return 0;
+}
@@ -0,0 +1,32 @@
+/*
+ * Opt-in real-time mode for the serial I/O path: pins the driver to a CPU,
+ * switches it to SCHED_FIFO and locks its memory (with the stack and a heap
+ * pool pre-faulted), so the sensor prompt is not missed because of the other
+ * processes of the gateway. Every step falls back to normal operation with a
+ * warning if the process lacks the privilege (CAP_SYS_NICE, CAP_IPC_LOCK or
+ * the rtprio/memlock limits).
+ *
+ * The wakeup latency (how late a timed sleep returns) is measured before and
+ * after enabling it, and continuously for every sleep of the driver.
+ */
+
+#ifndef CWS_REALTIME_H
+#define CWS_REALTIME_H
+
+#include "cws_histogram.h"
+
+#define RT_STACK_PREFAULT (256*1024)  // stack bytes touched before locking
+#define RT_HEAP_PREFAULT (1024*1024)  // heap bytes touched and kept by malloc
+#define RT_PROBE_SAMPLES 500          // sleeps of the wakeup latency probe
+#define RT_PROBE_PERIOD_US 1000
+
+#define RT_PINNED 1
+#define RT_FIFO 2
+#define RT_LOCKED 4
+
+extern cws_histogram rt_wakeup; // lateness of the driver sleeps (ms)
+
+int rt_enable(int cpu, int priority);
+int rt_probe_latency(cws_histogram* h);
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ * Comms flight recorder, see cws_recorder.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+
+#include "cws_recorder.h"
+#include "costof_simulator.h"
+
+typedef struct {
+	double time;   // epoch time of the first byte, to match the log lines
+	char dir;      // RECORDER_TX or RECORDER_RX
+	uint8_t len;
+	char data[RECORDER_CHUNK];
+}recorder_entry;
+
+static recorder_entry entries[RECORDER_ENTRIES];
+static unsigned long next_entry = 0;    // total entries used, the ring index is next_entry % RECORDER_ENTRIES
+static unsigned long dumped_entry = 0;  // next_entry at the last dump
+static int dumped_len = 0;              // length of the last entry at the last dump
+static int dump_count = 0;
+static char dump_prefix[256] = "/tmp/cws_comms";
+static char recorder_name[256] = "";
+static volatile sig_atomic_t dump_requested = 0;
+static char request_reason[128];
+static int dump_pending = 0;  // set by recorder_request
+
+
+static void recorder_signal(int sig){
+	dump_requested = 1;
+}
+
+
+/*
+ * Sets where the dumps are written (<prefix>.<epoch>.<n>.log) and installs the
+ * SIGUSR1 handler. Bytes are recorded even if this is never called
+ */
+void recorder_init(const char* path_prefix, const char* sensor_name){
+	struct sigaction sa;
+	if (path_prefix != NULL) {
+		strncpy(dump_prefix, path_prefix, sizeof(dump_prefix) - 1);
+	}
+	strncpy(recorder_name, sensor_name, sizeof(recorder_name) - 1);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = recorder_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+
+/*
+ * Records a transfer. Bytes are appended to the last entry if it goes in the
+ * same direction and was started recently, otherwise new entries are used
+ */
+void recorder_add(char dir, const char* data, int len){
+	recorder_entry* e = NULL;
+	double now;
+	if (len <= 0) {
+		return;
+	}
+	now = linux_get_epoch_time();
+	if (next_entry > 0) {
+		e = &entries[(next_entry - 1) % RECORDER_ENTRIES];
+		if (e->dir != dir || e->len >= RECORDER_CHUNK || (now - e->time)*1000 > RECORDER_MERGE_MS ||
+				(next_entry == dumped_entry && e->len == dumped_len)) {
+			e = NULL;
+		}
+	}
+	while (len > 0) {
+		if (e == NULL) {
+			e = &entries[next_entry % RECORDER_ENTRIES];
+			next_entry++;
+			e->time = now;
+			e->dir = dir;
+			e->len = 0;
+		}
+		int n = RECORDER_CHUNK - e->len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(&e->data[e->len], data, n);
+		e->len += n;
+		data += n;
+		len -= n;
+		e = NULL;
+	}
+}
+
+
+/*
+ * Writes the bytes of an entry escaping the non printable ones
+ */
+static void recorder_write_bytes(FILE* f, const recorder_entry* e){
+	int i;
+	for (i = 0 ; i < e->len ; i++) {
+		unsigned char c = e->data[i];
+		if (c == '\r') {
+			fputs("\\r", f);
+		} else if (c == '\n') {
+			fputs("\\n", f);
+		} else if (c == '"' || c == '\\') {
+			fprintf(f, "\\%c", c);
+		} else if (c < 0x20 || c >= 0x7f) {
+			fprintf(f, "\\x%02x", c);
+		} else {
+			fputc(c, f);
+		}
+	}
+}
+
+
+/*
+ * Dumps the ring to a new file. The reason is given as a printf format. If
+ * nothing was recorded since the previous dump (e.g. an error going up through
+ * several callers) nothing is written. Returns 0 on success or if skipped
+ */
+int recorder_dump(const char* format, ...){
+	char path[512];
+	char reason[256];
+	unsigned long first;
+	unsigned long i;
+	int last_len;
+	va_list ap;
+	FILE* f;
+
+	last_len = next_entry > 0 ? entries[(next_entry - 1) % RECORDER_ENTRIES].len : 0;
+	if (next_entry == dumped_entry && last_len == dumped_len) {
+		return 0;
+	}
+	va_start(ap, format);
+	vsnprintf(reason, sizeof(reason), format, ap);
+	va_end(ap);
+
+	snprintf(path, sizeof(path), "%s.%ld.%d.log", dump_prefix, (long)time(NULL), dump_count++);
+	f = fopen(path, "w");
+	if (f == NULL) {
+		speLOG(LOG_ERR, "could not write comms dump %s", path);
+		return -1;
+	}
+	fprintf(f, "# CWS comms flight recorder, sensor %s\n# reason: %s\n# epoch_time dir bytes\n", recorder_name, reason);
+	first = next_entry > RECORDER_ENTRIES ? next_entry - RECORDER_ENTRIES : 0;
+	for (i = first ; i < next_entry ; i++) {
+		const recorder_entry* e = &entries[i % RECORDER_ENTRIES];
+		// entries of the same transfer go in a single line
+		if (i == first || e->dir != entries[(i - 1) % RECORDER_ENTRIES].dir ||
+				(e->time - entries[(i - 1) % RECORDER_ENTRIES].time)*1000 > RECORDER_MERGE_MS) {
+			fprintf(f, "%s%.6f %s \"", i == first ? "" : "\"\n", e->time, e->dir == RECORDER_TX ? "TX" : "RX");
+		}
+		recorder_write_bytes(f, e);
+	}
+	if (next_entry > first) {
+		fputs("\"\n", f);
+	}
+	fclose(f);
+	dumped_entry = next_entry;
+	dumped_len = last_len;
+	speLOG(LOG_WARNING, "comms dumped to %s (%s)", path, reason);
+	return 0;
+}
+
+
+/*
+ * Asks for a dump at the next safe point. For other threads than the one
+ * talking to the sensor, which can't read the ring while it is written
+ */
+void recorder_request(const char* reason){
+	strncpy(request_reason, reason, sizeof(request_reason) - 1);
+	__atomic_store_n(&dump_pending, 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Dumps the ring if a SIGUSR1 was received or a dump was requested. To be
+ * called at safe points
+ */
+void recorder_poll(){
+	if (__atomic_exchange_n(&dump_pending, 0, __ATOMIC_ACQUIRE)) {
+		recorder_dump("%s", request_reason);
+	}
+	if (dump_requested) {
+		dump_requested = 0;
+		dumped_entry = (unsigned long)-1; // always dump on request
+		recorder_dump("signal");
+	}
+}
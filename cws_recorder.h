@@ -0,0 +1,28 @@
+/*
+ * Comms flight recorder. The last bytes sent to and received from the sensor
+ * are always kept, with their timestamps, in a fixed-size in-memory ring
+ * (oldest overwritten). The ring is dumped to a text file when an operation
+ * gives up, when a response can't be parsed or on SIGUSR1, so failures in the
+ * field can be analyzed without verbose logging. Every driver process talks to
+ * a single sensor, so the recorder is per sensor.
+ *
+ * Recording a transfer costs a clock read and a memcpy into a static buffer.
+ */
+
+#ifndef CWS_RECORDER_H
+#define CWS_RECORDER_H
+
+#define RECORDER_ENTRIES 1024   // ring entries, older ones are overwritten
+#define RECORDER_CHUNK 22       // bytes per entry, so an entry takes 32 bytes
+#define RECORDER_MERGE_MS 10    // consecutive transfers closer than this share an entry
+
+#define RECORDER_TX 'T'
+#define RECORDER_RX 'R'
+
+void recorder_init(const char* path_prefix, const char* sensor_name);
+void recorder_add(char dir, const char* data, int len);
+int recorder_dump(const char* format, ...);
+void recorder_request(const char* reason);
+void recorder_poll();
+
+#endif
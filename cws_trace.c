@@ -0,0 +1,149 @@
+/*
+ * Timeline tracer, see cws_trace.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "cws_trace.h"
+#include "costof_simulator.h"
+
+typedef struct {
+	uint64_t ts_ns;   // monotonic timestamp
+	const char* name;
+	char arg[TRACE_ARG_SIZE];
+	char phase;       // 'B' begin, 'E' end, 'i' instant
+	int tid;
+}trace_event;
+
+int trace_enabled = 0;
+
+static trace_event* events = NULL;
+static unsigned long next_event = 0; // total events added, the ring index is next_event % TRACE_MAX_EVENTS
+static int trace_sensor_id = 0;
+static char trace_sensor_name[256];
+
+
+/*
+ * Allocates the event buffer and enables tracing
+ */
+int trace_init(int sensor_id, const char* sensor_name){
+	events = fastMalloc(TRACE_MAX_EVENTS*sizeof(trace_event));
+	if (events == NULL) {
+		speLOG(LOG_ERR, "could not allocate trace buffer");
+		return -1;
+	}
+	memset(events, 0, TRACE_MAX_EVENTS*sizeof(trace_event));
+	trace_sensor_id = sensor_id;
+	strncpy(trace_sensor_name, sensor_name, sizeof(trace_sensor_name) - 1);
+	next_event = 0;
+	trace_enabled = 1;
+	return 0;
+}
+
+
+/*
+ * Sets the sensor id written in the events, once it is known (the serial
+ * number comes in the sensor frames)
+ */
+void trace_set_sensor(int sensor_id){
+	trace_sensor_id = sensor_id;
+}
+
+
+/*
+ * Adds an event to the ring buffer. Safe to call from several threads, each
+ * caller gets its own slot
+ */
+void trace_event_add(char phase, const char* name, const char* arg){
+	struct timespec ts;
+	unsigned long n = __atomic_fetch_add(&next_event, 1, __ATOMIC_RELAXED);
+	trace_event* ev = &events[n % TRACE_MAX_EVENTS];
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ev->ts_ns = (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+	ev->name = name;
+	ev->phase = phase;
+	ev->tid = syscall(SYS_gettid);
+	if (arg != NULL) {
+		strncpy(ev->arg, arg, TRACE_ARG_SIZE - 1);
+		ev->arg[TRACE_ARG_SIZE - 1] = 0;
+	} else {
+		ev->arg[0] = 0;
+	}
+}
+
+
+/*
+ * Writes a string escaping the characters not allowed in a JSON string
+ */
+static void trace_json_string(FILE* f, const char* s){
+	fputc('"', f);
+	for ( ; *s ; s++) {
+		if (*s == '"' || *s == '\\') {
+			fprintf(f, "\\%c", *s);
+		} else if ((unsigned char)*s < 0x20) {
+			fprintf(f, "\\u%04x", *s);
+		} else {
+			fputc(*s, f);
+		}
+	}
+	fputc('"', f);
+}
+
+
+/*
+ * Dumps the events in memory (oldest first) to path in Chrome trace-event
+ * JSON format. Returns the number of events written or -1 on error
+ */
+int trace_dump(const char* path){
+	unsigned long first, last, i;
+	int pid = getpid();
+	FILE* f;
+
+	if (!trace_enabled) {
+		return 0;
+	}
+	f = fopen(path, "w");
+	if (f == NULL) {
+		speLOG(LOG_ERR, "could not open trace file %s", path);
+		return -1;
+	}
+	last = __atomic_load_n(&next_event, __ATOMIC_RELAXED);
+	first = (last > TRACE_MAX_EVENTS) ? last - TRACE_MAX_EVENTS : 0;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":", pid);
+	trace_json_string(f, trace_sensor_name);
+	fprintf(f, "}}");
+	for (i = first ; i < last ; i++) {
+		trace_event* ev = &events[i % TRACE_MAX_EVENTS];
+		fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,",
+				ev->name, ev->phase, ((double)ev->ts_ns)/1000.0, pid, ev->tid);
+		if (ev->phase == 'i') {
+			fprintf(f, "\"s\":\"t\",");
+		}
+		fprintf(f, "\"args\":{\"sensor\":%d", trace_sensor_id);
+		if (ev->arg[0]) {
+			fprintf(f, ",\"arg\":");
+			trace_json_string(f, ev->arg);
+		}
+		fprintf(f, "}}");
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	return (int)(last - first);
+}
+
+
+/*
+ * Discards all the events in memory
+ */
+void trace_reset(){
+	__atomic_store_n(&next_event, 0, __ATOMIC_RELAXED);
+}
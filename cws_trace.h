@@ -0,0 +1,46 @@
+/*
+ * Timeline tracer. Begin/end events with monotonic timestamps are stored in a
+ * bounded in-memory ring buffer and dumped in Chrome trace-event JSON format,
+ * which can be opened with Perfetto (ui.perfetto.dev) or chrome://tracing.
+ *
+ * Tracing is disabled unless trace_init is called. When disabled every trace
+ * point costs a single predictable branch on a global flag.
+ */
+
+#ifndef CWS_TRACE_H
+#define CWS_TRACE_H
+
+#define TRACE_MAX_EVENTS 8192  // events kept in memory, older ones are overwritten
+#define TRACE_ARG_SIZE 24
+
+extern int trace_enabled;
+
+/*
+ * Trace points. name must be a string literal (only the pointer is stored),
+ * arg is copied and can be NULL
+ */
+#define TRACE_BEGIN(name, arg) do { \
+	if (__builtin_expect(trace_enabled, 0)) { \
+		trace_event_add('B', name, arg); \
+	} \
+} while (0)
+
+#define TRACE_END(name, arg) do { \
+	if (__builtin_expect(trace_enabled, 0)) { \
+		trace_event_add('E', name, arg); \
+	} \
+} while (0)
+
+#define TRACE_INSTANT(name, arg) do { \
+	if (__builtin_expect(trace_enabled, 0)) { \
+		trace_event_add('i', name, arg); \
+	} \
+} while (0)
+
+int trace_init(int sensor_id, const char* sensor_name);
+void trace_set_sensor(int sensor_id);
+void trace_event_add(char phase, const char* name, const char* arg);
+int trace_dump(const char* path);
+void trace_reset();
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * Link watchdog for the serial connection with the CWS sensor, see
+ * cws_watchdog.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+#include "cws_watchdog.h"
+#include "costof_simulator.h"
+#include "linux_uart.h"
+
+const char* wd_step_str[] = {"probe", "serial break", "DTR/RTS toggle", "reopen", "failed"};
+
+
+/*
+ * Initializes the watchdog structure and starts watching the device node with
+ * inotify. If inotify is not available the watchdog still works, but the
+ * node removal is only detected by read errors
+ */
+int wd_init(cws_watchdog* wd, const char* device){
+	char dir[256];
+	memset(wd, 0, sizeof(cws_watchdog));
+	strncpy(wd->device, device, sizeof(wd->device) - 1);
+
+	strncpy(dir, device, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = 0;
+
+	wd->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (wd->inotify_fd < 0) {
+		speLOG(LOG_WARNING, "watchdog: inotify not available, device removal won't be detected");
+		return 0;
+	}
+	if (inotify_add_watch(wd->inotify_fd, dirname(dir), IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) < 0) {
+		speLOG(LOG_WARNING, "watchdog: could not watch %s", dir);
+		close(wd->inotify_fd);
+		wd->inotify_fd = -1;
+	}
+	return 0;
+}
+
+
+/*
+ * Consumes pending inotify events and updates the node_gone flag. Returns
+ * immediately if there's nothing to read
+ */
+static void wd_check_node(cws_watchdog* wd){
+	char buff[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char name[256];
+	int n;
+
+	if (wd->inotify_fd < 0) {
+		return;
+	}
+	strncpy(name, wd->device, sizeof(name) - 1);
+	name[sizeof(name) - 1] = 0;
+	const char* node = basename(name);
+
+	while ((n = read(wd->inotify_fd, buff, sizeof(buff))) > 0) {
+		char* p = buff;
+		while (p < buff + n) {
+			struct inotify_event* ev = (struct inotify_event*)p;
+			if (ev->len > 0 && !strcmp(ev->name, node)) {
+				if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+					speLOG(LOG_WARNING, "watchdog: device %s removed", wd->device);
+					wd->node_gone = 1;
+				}
+				else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+					speLOG(LOG_INFO, "watchdog: device %s is back", wd->device);
+					wd->node_gone = 0;
+				}
+			}
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+}
+
+
+/*
+ * Reports the result of a transaction with the sensor
+ */
+void wd_report(cws_watchdog* wd, wd_event ev){
+	switch (ev) {
+		case WD_EV_OK:
+			wd->failures = 0;
+			wd->next_step = WD_STEP_PROBE;
+			break;
+		case WD_EV_TIMEOUT:
+			wd->failures++;
+			wd->timeouts++;
+			break;
+		case WD_EV_READ_ERROR:
+			wd->failures++;
+			wd->read_errors++;
+			break;
+	}
+}
+
+
+/*
+ * Returns 1 if the link is considered dead, 0 otherwise
+ */
+int wd_link_dead(cws_watchdog* wd){
+	wd_check_node(wd);
+	if (wd->node_gone || wd->failures >= WD_MAX_FAILURES) {
+		return 1;
+	}
+	return 0;
+}
+
+
+/*
+ * Closes the port and opens it again. If the device node has disappeared, waits
+ * until it shows up again (or WD_REOPEN_TIMEOUT_MS or the deadline expires)
+ */
+static int wd_reopen(cws_watchdog* wd, int* fd, int baudrate, double deadline){
+	double end = linux_get_monotonic_time() + WD_REOPEN_TIMEOUT_MS/1000.0;
+	double now;
+
+	if (end > deadline) {
+		end = deadline;
+	}
+	if (*fd > 0) {
+		linux_close_uart(*fd);
+		*fd = -1;
+	}
+
+	while (1) {
+		wd_check_node(wd);
+		if (access(wd->device, F_OK) == 0) {
+			*fd = linux_open_uart(wd->device, baudrate);
+			if (*fd > 0) {
+				wd->node_gone = 0;
+				return 0;
+			}
+		}
+		now = linux_get_monotonic_time();
+		if (now >= end) {
+			break;
+		}
+		// wait for the node to be created (or just retry in 1 sec)
+		int wait_ms = (end - now) < 1.0 ? (int)(1000*(end - now)) + 1 : 1000;
+		if (wd->inotify_fd >= 0) {
+			struct pollfd pfd = {wd->inotify_fd, POLLIN, 0};
+			poll(&pfd, 1, wait_ms);
+		} else {
+			usleep(1000*wait_ms);
+		}
+	}
+	return -1;
+}
+
+
+/*
+ * Tries to recover the link, escalating from the cheapest to the most
+ * intrusive action. After every step the link is checked with the probe
+ * function. If the device node is gone we go straight to the reopen step.
+ * No step is started after the deadline (monotonic secs) and the reopen wait
+ * ends at it. A recovery that runs out of time doesn't start over on the next
+ * call, it carries on from the first step not tried yet (the reopen is tried
+ * again until the link is back), so short budgets still escalate. The time
+ * spent is recorded in the watchdog statistics.
+ *
+ * Returns the step that recovered the link or -1 if all of them failed
+ */
+int wd_recover(cws_watchdog* wd, int* fd, int baudrate, wd_probe_func probe, void* arg, double deadline){
+	double start = linux_get_monotonic_time();
+	wd_step step = WD_STEP_PROBE;
+	wd_step first = wd->next_step;
+
+	if (wd_link_dead(wd) && wd->node_gone) {
+		first = WD_STEP_REOPEN;
+	}
+
+	for (step = first ; step < WD_STEP_FAILED ; step++) {
+		int r = 0;
+		int hold_ms;
+		if (linux_get_monotonic_time() >= deadline) {
+			speLOG(LOG_WARNING, "watchdog: no time left for %s", wd_step_str[step]);
+			wd->next_step = step;
+			step = WD_STEP_FAILED;
+			break;
+		}
+		wd->next_step = (step < WD_STEP_REOPEN) ? step + 1 : WD_STEP_REOPEN;
+		switch (step) {
+			case WD_STEP_PROBE:
+				break;
+			case WD_STEP_BREAK:
+				r = linux_send_break(*fd);
+				break;
+			case WD_STEP_MODEM_LINES:
+				hold_ms = (int)(1000*(deadline - linux_get_monotonic_time()));
+				r = linux_toggle_modem_lines(*fd, hold_ms < WD_MODEM_HOLD_MS ? hold_ms : WD_MODEM_HOLD_MS);
+				break;
+			case WD_STEP_REOPEN:
+				r = wd_reopen(wd, fd, baudrate, deadline);
+				break;
+			default:
+				break;
+		}
+		if (r < 0) {
+			speLOG(LOG_WARNING, "watchdog: %s failed", wd_step_str[step]);
+			continue;
+		}
+		if (probe(arg, deadline) >= 0) {
+			break;
+		}
+		speLOG(LOG_WARNING, "watchdog: link still dead after %s", wd_step_str[step]);
+	}
+
+	wd->last_recovery_ms = 1000*(linux_get_monotonic_time() - start);
+	wd->total_recovery_ms += wd->last_recovery_ms;
+	if (wd->last_recovery_ms > wd->max_recovery_ms) {
+		wd->max_recovery_ms = wd->last_recovery_ms;
+	}
+	wd->recoveries[step]++;
+
+	if (step == WD_STEP_FAILED) {
+		speLOG(LOG_ERR, "watchdog: could not recover link after %.1f ms", wd->last_recovery_ms);
+		return -1;
+	}
+	wd->failures = 0;
+	wd->next_step = WD_STEP_PROBE;
+	speLOG(LOG_NOTICE, "watchdog: link recovered by %s in %.1f ms", wd_step_str[step], wd->last_recovery_ms);
+	return step;
+}
+
+
+void wd_close(cws_watchdog* wd){
+	if (wd->inotify_fd >= 0) {
+		close(wd->inotify_fd);
+		wd->inotify_fd = -1;
+	}
+}
@@ -0,0 +1,61 @@
+/*
+ * Link watchdog for the serial connection with the CWS sensor. It detects a
+ * dead link (consecutive prompt timeouts, read errors or the device node
+ * disappearing) and recovers it escalating through a serial break, a DTR/RTS
+ * toggle and a full reopen of the port.
+ */
+
+#ifndef CWS_WATCHDOG_H
+#define CWS_WATCHDOG_H
+
+#define WD_MAX_FAILURES 3        // consecutive failures to consider the link dead
+#define WD_REOPEN_TIMEOUT_MS 30000 // max time waiting for the device node to come back
+#define WD_MODEM_HOLD_MS 500     // time DTR/RTS are kept low
+
+typedef enum {
+	WD_EV_OK = 0,        // successful transaction
+	WD_EV_TIMEOUT,       // prompt or response not received in time
+	WD_EV_READ_ERROR     // read() failed or device hung up
+}wd_event;
+
+typedef enum {
+	WD_STEP_PROBE = 0,   // link was fine, just probing succeeded
+	WD_STEP_BREAK,
+	WD_STEP_MODEM_LINES,
+	WD_STEP_REOPEN,
+	WD_STEP_FAILED,
+	WD_STEPS_COUNT
+}wd_step;
+
+typedef struct {
+	char device[256];
+	int inotify_fd;      // watches the directory of the device node, -1 if not available
+	int node_gone;       // 1 if the device node has been removed
+
+	wd_step next_step;   // first step of the next recovery, escalation carries on across calls
+	int failures;        // consecutive failures
+	int timeouts;        // total timeouts
+	int read_errors;     // total read errors
+
+	// recovery statistics
+	int recoveries[WD_STEPS_COUNT];  // recoveries per step that fixed the link
+	double last_recovery_ms;
+	double max_recovery_ms;
+	double total_recovery_ms;
+}cws_watchdog;
+
+/*
+ * Function used to check if the sensor answers before the deadline (monotonic
+ * secs), should return 0 if the link is alive and a negative value otherwise
+ */
+typedef int (*wd_probe_func)(void* arg, double deadline);
+
+int wd_init(cws_watchdog* wd, const char* device);
+void wd_report(cws_watchdog* wd, wd_event ev);
+int wd_link_dead(cws_watchdog* wd);
+int wd_recover(cws_watchdog* wd, int* fd, int baudrate, wd_probe_func probe, void* arg, double deadline);
+void wd_close(cws_watchdog* wd);
+
+extern const char* wd_step_str[];
+
+#endif
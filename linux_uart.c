@@ -10,16 +10,27 @@
 #include <stdlib.h>
 #include <termios.h>
 #include <stdio.h>
+#include <time.h>
+#include <linux/serial.h>
+
+#include "linux_uart.h"
 
 struct termios current_settings;
 struct termios original_settings;
 
+static linux_uart_stats uart_stats[LINUX_UART_MAX_FDS];
+static char uart_framed[LINUX_UART_MAX_FDS];  // ports opened in framing mode
+static int framing_mode = 0;                  // framing mode for the ports opened from now on
+
+#define UART_STATS(fd) (((fd) >= 0 && (fd) < LINUX_UART_MAX_FDS) ? &uart_stats[fd] : NULL)
+
 
 int linux_set_baudrate(int fd, long int baudrate_in);
+static void linux_uart_stats_reset(int fd);
 
 /*
- * Opens a Linux UART and returns a pointer to the Linux_UART structure containing
- * its settings and file descriptor
+ * Opens a Linux UART and returns its file descriptor. On failure the port is
+ * released and -1 is returned, so the caller can decide whether to retry
  */
 int linux_open_uart(char* serial_device, int baudrate){
 	int status;
@@ -33,23 +44,23 @@ int linux_open_uart(char* serial_device, int baudrate){
 	//open serial port and assign a file descriptor
 	int fd = open(serial_device, O_RDWR | O_NOCTTY | O_NDELAY);
 	if(fd==-1)   {
-		printf("ERROR unable to open comport \n");
-		exit(1);
+		printf("ERROR unable to open comport %s\n", serial_device);
+		return -1;
 	}
 
 	  /* lock access so that another process can't also use the port */
 	if(flock(fd, LOCK_EX | LOCK_NB) != 0) {
 		close(fd);
 		printf( "ERROR Another process has locked the comport\n");
-		exit(1);
+		return -1;
 	}
 
 	error = tcgetattr(fd, &original_settings);
 	if(error==-1)  {
-		close(fd);
 	    flock(fd, LOCK_UN);  /* free the port so that others can use it. */
+		close(fd);
 	    printf("ERROR unable to read portsettings\n");
-	    exit(1);
+	    return -1;
 	}
 	memset(&current_settings, 0, sizeof(current_settings));  /* clear the new struct */
 
@@ -59,27 +70,42 @@ int linux_open_uart(char* serial_device, int baudrate){
 	current_settings.c_lflag = 0;
 	current_settings.c_cc[VMIN] = 0;      /* block until n bytes are received */
 	current_settings.c_cc[VTIME] = 0;     /* block until a timer expires (n * 100 mSec.) */
+	if (framing_mode) {
+		// Canonical mode: the line discipline delimits the frames, every read returns
+		// a line ending with '\n' or a prompt ending with '>'. All the other special
+		// characters are disabled so the data is never edited
+		int i;
+		for (i = 0 ; i < NCCS ; i++) {
+			current_settings.c_cc[i] = _POSIX_VDISABLE;
+		}
+		current_settings.c_lflag = ICANON;
+		current_settings.c_cc[VEOL] = '>';
+		current_settings.c_cc[VEOL2] = '\n';
+	}
 
 	//set baudrate
+	if (linux_set_baudrate(fd, baudrate) != 0) {
+		return -1; // port already released by linux_set_baudrate
+	}
+	if (fd < LINUX_UART_MAX_FDS) {
+		uart_framed[fd] = framing_mode;
+	}
 
-	 linux_set_baudrate(fd, baudrate);
-
+	// Modem lines are not essential to talk to the sensor: ports without them
+	// (pseudo terminals, some adapters) are still usable
 	if(ioctl(fd, TIOCMGET, &status) == -1) {
-		tcsetattr(fd, TCSANOW, &original_settings );
-		flock(fd, LOCK_UN);  /* free the port so that others can use it. */
-		printf("ERROR unable to get portstatus\n");
-		exit(1);
+		printf("WARNING unable to get portstatus, modem lines not available\n");
+		linux_uart_stats_reset(fd);
+		return fd;
 	}
 
 	status |= TIOCM_DTR;    /* turn on DTR */
 	status |= TIOCM_RTS;    /* turn on RTS */
 
 	if(ioctl(fd, TIOCMSET, &status) == -1) {
-		tcsetattr(fd, TCSANOW, &original_settings);
-		flock(fd, LOCK_UN);  /* free the port so that others can use it. */
-		printf("ERROR unable to set port status");
-		exit(1);
+		printf("WARNING unable to set port status\n");
 	}
+	linux_uart_stats_reset(fd);
 	return fd;
 }
 
@@ -126,6 +152,8 @@ int linux_set_baudrate(int fd, long int baudrate_in){
 		case 4000000 : baudr = B4000000; break;
 #endif
 		default      : printf( "ERROR invalid baudrate %li \n", baudrate_in);
+		   flock(fd, LOCK_UN);
+		   close(fd);
 		   return -1;
 		   break;
 	  }
@@ -134,8 +162,8 @@ int linux_set_baudrate(int fd, long int baudrate_in){
 
 	  if((tcsetattr(fd, TCSANOW, &current_settings))==-1) {
 		tcsetattr(fd, TCSANOW, &original_settings);
-		close(fd);
 		flock(fd, LOCK_UN);  /* free the port so that others can use it. */
+		close(fd);
 		printf("unable to adjust port settings \n");
 		return(1);
 	  }
@@ -146,7 +174,12 @@ int linux_set_baudrate(int fd, long int baudrate_in){
 
 
 int linux_write_uart(int fd, void* buffer, int size){
-	return write(fd, buffer, size);
+	int n = write(fd, buffer, size);
+	linux_uart_stats* st = UART_STATS(fd);
+	if (n > 0 && st != NULL) {
+		st->tx_bytes += n;
+	}
+	return n;
 }
 
 int linux_fflush_uart(int fd){
@@ -165,8 +198,8 @@ int linux_fflush_uart(int fd){
 int char_ready(int fd, int tmout){
 	fd_set fds;
 	struct timeval tv;
-	tv.tv_sec=0;
-	tv.tv_usec=tmout;
+	tv.tv_sec=tmout/1000000;
+	tv.tv_usec=tmout%1000000;
 	FD_ZERO(&fds);
 	FD_SET(fd, &fds);
 	if(select(fd+1, &fds, NULL, NULL, &tv)<1) return -1;
@@ -174,10 +207,45 @@ int char_ready(int fd, int tmout){
 	return ret;
 }
 
+/*
+ * Reads a frame from a port in framing mode: waits until the line discipline
+ * has a whole frame (or the timeout expires) and reads it with a single call.
+ * Returns the bytes read, 0 on timeout or -1 on error
+ */
+static int linux_read_frame(int fd, char* buffer, int max_bytes, long int timeout_us){
+	linux_uart_stats* st = UART_STATS(fd);
+	int n;
+	if (st != NULL) {
+		st->wakeups++;
+	}
+	if (char_ready(fd, timeout_us) <= 0) {
+		return 0;
+	}
+	n = read(fd, buffer, max_bytes);
+	if (st != NULL) {
+		st->read_calls++;
+	}
+	if (n <= 0) {
+		// readable but nothing to read: the device has been hung up
+		if (st != NULL) {
+			st->read_errors++;
+		}
+		return -1;
+	}
+	if (st != NULL) {
+		st->rx_bytes += n;
+	}
+	return n;
+}
+
+
 int linux_read_uart(int fd, char* buffer, int max_bytes, long int timeout_us){
 	if (fd <= 0) {
 		return(-1);
 	}
+	if (fd < LINUX_UART_MAX_FDS && uart_framed[fd]) {
+		return linux_read_frame(fd, buffer, max_bytes, timeout_us);
+	}
 	int nbytes=0;
 
 
@@ -190,6 +258,8 @@ int linux_read_uart(int fd, char* buffer, int max_bytes, long int timeout_us){
 	//double start_time= (double)t.tv_sec + ((double)t.tv_usec)/1000000;
 	ulong start=t.tv_sec*1000000+t.tv_usec;
 	ulong now;
+	linux_uart_stats* st = UART_STATS(fd);
+	int backlog;
 
 	tmout_flag=0;
 	while((!tmout_flag) && (!end_tx_token) && (nbytes<max_bytes)) {
@@ -198,14 +268,34 @@ int linux_read_uart(int fd, char* buffer, int max_bytes, long int timeout_us){
 		if(now > (start + timeout_us)){
 			tmout_flag=1;
 		}
+		if (st != NULL) {
+			st->wakeups++;
+		}
 		if(char_ready(fd, char_tmout)>0){
+			if (st != NULL && ioctl(fd, FIONREAD, &backlog) == 0 && backlog > st->rx_backlog_max) {
+				st->rx_backlog_max = backlog;
+			}
 			int tmp_bytes=read(fd, buffer+nbytes , (max_bytes-nbytes));
+			if (st != NULL) {
+				st->read_calls++;
+			}
 			char_tmout=10*timeout_us/max_bytes;
-			if(tmp_bytes<0){
-				printf( "ERROR UART, %d", tmp_bytes);
+			if(tmp_bytes<0 || (tmp_bytes==0 && nbytes==0)){
+				// select() flagged the port as readable but there is nothing to read:
+				// the device has been hung up (e.g. USB adapter unplugged)
+				printf( "ERROR UART, %d\n", tmp_bytes);
+				if (st != NULL) {
+					st->read_errors++;
+				}
+				if (nbytes == 0) {
+					return -1;
+				}
 				return nbytes;
 			}
 			nbytes += tmp_bytes;
+			if (st != NULL) {
+				st->rx_bytes += tmp_bytes;
+			}
 		}
 	}
 
@@ -213,7 +303,135 @@ int linux_read_uart(int fd, char* buffer, int max_bytes, long int timeout_us){
 }
 
 int linux_close_uart(int fd){
+	flock(fd, LOCK_UN);
 	return close(fd);
 }
 
+/*
+ * Sends a serial break (line held low for ~250 ms), which resets the framing
+ * state machine of most UARTs and USB-serial adapters
+ */
+int linux_send_break(int fd){
+	tcflush(fd, TCIOFLUSH);
+	return tcsendbreak(fd, 0);
+}
+
+/*
+ * Drops DTR and RTS for holdMs milliseconds and raises them again. Many
+ * USB-serial adapters reset their internal state on a modem line transition
+ */
+int linux_toggle_modem_lines(int fd, int holdMs){
+	int status;
+	if(ioctl(fd, TIOCMGET, &status) == -1) {
+		return -1;
+	}
+	status &= ~(TIOCM_DTR | TIOCM_RTS);
+	if(ioctl(fd, TIOCMSET, &status) == -1) {
+		return -1;
+	}
+	usleep(1000*holdMs);
+	status |= TIOCM_DTR | TIOCM_RTS;
+	if(ioctl(fd, TIOCMSET, &status) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+
+
+
+static double linux_uart_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ((double)ts.tv_nsec) / 1e9;
+}
+
+/*
+ * Reads the kernel error counters of the port. Returns -1 if the driver does
+ * not support TIOCGICOUNT (e.g. pseudo terminals)
+ */
+static int linux_uart_icount(int fd, int counters[5]){
+	struct serial_icounter_struct icount;
+	if (ioctl(fd, TIOCGICOUNT, &icount) < 0) {
+		return -1;
+	}
+	counters[0] = icount.frame;
+	counters[1] = icount.overrun;
+	counters[2] = icount.parity;
+	counters[3] = icount.brk;
+	counters[4] = icount.buf_overrun;
+	return 0;
+}
 
+/*
+ * Clears the statistics of a port, kernel counters are reported from now on
+ */
+static void linux_uart_stats_reset(int fd){
+	linux_uart_stats* st = UART_STATS(fd);
+	if (st == NULL) {
+		return;
+	}
+	memset(st, 0, sizeof(linux_uart_stats));
+	st->icount_valid = (linux_uart_icount(fd, st->icount_base) == 0);
+	st->last_time = linux_uart_now();
+}
+
+/*
+ * Copies the statistics of the port to stats, refreshing the kernel counters.
+ * It costs a single ioctl. The rates are the ones of the last window closed
+ * by linux_uart_update_rates, so any number of readers get the same values
+ */
+int linux_uart_get_stats(int fd, linux_uart_stats* stats){
+	linux_uart_stats* st = UART_STATS(fd);
+	int counters[5];
+	if (st == NULL) {
+		return -1;
+	}
+	if (st->icount_valid && linux_uart_icount(fd, counters) == 0) {
+		st->frame = counters[0] - st->icount_base[0];
+		st->overrun = counters[1] - st->icount_base[1];
+		st->parity = counters[2] - st->icount_base[2];
+		st->brk = counters[3] - st->icount_base[3];
+		st->buf_overrun = counters[4] - st->icount_base[4];
+	}
+	memcpy(stats, st, sizeof(linux_uart_stats));
+	return 0;
+}
+
+
+/*
+ * Computes the throughput since the previous call (or since the port was
+ * opened) and starts a new window. To be called by a single owner, once per
+ * reporting period (the driver does it at the end of every cycle)
+ */
+int linux_uart_update_rates(int fd){
+	linux_uart_stats* st = UART_STATS(fd);
+	double now = linux_uart_now();
+	if (st == NULL) {
+		return -1;
+	}
+	if (now > st->last_time) {
+		st->rx_rate = (st->rx_bytes - st->last_rx)/(now - st->last_time);
+		st->tx_rate = (st->tx_bytes - st->last_tx)/(now - st->last_time);
+	}
+	st->last_time = now;
+	st->last_rx = st->rx_bytes;
+	st->last_tx = st->tx_bytes;
+	return 0;
+}
+
+
+/*
+ * Enables or disables the framing mode for the ports opened from now on. In
+ * framing mode the tty line discipline delimits the frames of the sensor
+ * (canonical mode, lines end with '\n' and the prompt with '>'), so every read
+ * returns a whole frame instead of the fragments that arrived so far
+ */
+void linux_uart_set_framing(int enable){
+	framing_mode = enable;
+}
+
+
+int linux_uart_framed(int fd){
+	return (fd >= 0 && fd < LINUX_UART_MAX_FDS) ? uart_framed[fd] : 0;
+}
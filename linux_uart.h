@@ -7,6 +7,39 @@
  * Structure that holds the information for LINUX UART devices
  */
 
+#define LINUX_UART_MAX_FDS 64 // statistics are kept for file descriptors below this value
+
+/*
+ * Link statistics of a port. Byte counters are updated on every read/write,
+ * kernel counters (TIOCGICOUNT) when linux_uart_get_stats is called and rates
+ * when linux_uart_update_rates is called
+ */
+typedef struct {
+	unsigned long tx_bytes;
+	unsigned long rx_bytes;
+	unsigned long read_errors;
+	unsigned long read_calls;  // read() syscalls
+	unsigned long wakeups;     // select() calls waiting for data
+	int rx_backlog_max;    // high-water mark of bytes waiting in the kernel buffer (FIONREAD)
+
+	// kernel counters since the port was opened, only if icount_valid
+	int icount_valid;
+	int frame;
+	int overrun;           // hardware overruns (UART FIFO)
+	int parity;
+	int brk;
+	int buf_overrun;       // tty buffer overruns (user space too slow)
+
+	// throughput between the last two calls to linux_uart_update_rates (bytes/s)
+	double rx_rate;
+	double tx_rate;
+
+	// internal, used to compute rates and deltas
+	double last_time;
+	unsigned long last_rx;
+	unsigned long last_tx;
+	int icount_base[5];
+}linux_uart_stats;
 
 
 int linux_open_uart(char* device, int baudrate);
@@ -15,6 +48,12 @@ int linux_read_uart(int fd, char* buffer, int max_bytes, long int timeout_us);
 int linux_close_uart(int fd);
 int linux_fflush_uart(int fd);
 int linux_set_baudrate(int fd, long int baudrate);
+int linux_send_break(int fd);
+int linux_toggle_modem_lines(int fd, int holdMs);
+int linux_uart_get_stats(int fd, linux_uart_stats* stats);
+int linux_uart_update_rates(int fd);
+void linux_uart_set_framing(int enable);
+int linux_uart_framed(int fd);
 
 
 #endif //LINUX_UART_H_
@@ -12,6 +12,16 @@
 #include <string.h>
 #include <unistd.h>
 #include "costof_simulator.h"
+#include "linux_uart.h"
+#include "cws_control.h"
+#include "cws_trace.h"
+#include "cws_history.h"
+#include "cws_query.h"
+#include "cws_bench.h"
+#include "cws_recorder.h"
+#include "cws_realtime.h"
+#include "cws_pipeline.h"
+#include "cws_health.h"
 
 
 typedef enum  {  // Operational states of the sensor
@@ -23,19 +33,36 @@ typedef enum  {  // Operational states of the sensor
 
 char* cws_states_str[] = {"UNKNOWN", "IDLE", "OPERATING", "SLEEPING"};
 
+/*
+ * Deadline of an operation, as monotonic time in seconds. Every cws_ operation
+ * gets the deadline of its caller and never runs past it, nested calls and
+ * retries only use what is left of the budget
+ */
+typedef double cws_deadline;
+
 // Internal functions
-int cws_get_prompt(LibSensor* self);
+int cws_get_prompt(LibSensor* self, cws_deadline deadline);
 int cws_sleep(int msecs);
-int cws_send_command(LibSensor* self, char* cmd, int prompt);
-int cws_get_response(LibSensor* self, char* response, int respsize, int timeoutMs);
-int cws_get_state(LibSensor *self, cws_state* state);
-int cws_wait_until_state(LibSensor* self, cws_state target_state, int timeoutMs);
-int cws_get_sample(LibSensor* self );
+int cws_send_command(LibSensor* self, char* cmd, int prompt, cws_deadline deadline);
+int cws_get_response(LibSensor* self, char* response, int respsize, cws_deadline deadline);
+int cws_get_state(LibSensor *self, cws_state* state, cws_deadline deadline);
+int cws_wait_until_state(LibSensor* self, cws_state target_state, cws_deadline deadline);
+int cws_get_sample(LibSensor* self, cws_deadline deadline);
+void cws_process_sample(char* frame, void* arg);
+
+
+int cws_probe_link(void* arg, double deadline);
+int cws_recover_link(LibSensor* self, cws_deadline deadline);
+int cws_idle(LibSensor* self, int msecs, cws_deadline deadline);
+int cws_format_stats(LibSensor* self, char* buff, int size);
+int cws_write_stats(LibSensor* self, const char* path);
+void cws_log_link_stats(LibSensor* self);
 
 
 // Global functions
-int sensor_init(LibSensor *self);
-int sensor_measure(LibSensor *self);
+int sensor_init(LibSensor *self, cws_deadline deadline);
+int sensor_measure(LibSensor *self, cws_deadline deadline);
+int sensor_resume(LibSensor *self, cws_deadline deadline);
 
 
 //#define SIMULATE_RESPONSE  // if set, the driver will simulate a response instead of waiting for the sensor
@@ -44,10 +71,20 @@ int sensor_measure(LibSensor *self);
 #define CHLORINATOR_TIME_SECS 5
 #define RISING_MODE_TIME_SECS 5
 #define CWS_MEAS_TIMEOUT_MIN 20 // 20 minutes
+#define CWS_PROMPT_TIMEOUT_MS 5000   // budget to get the prompt after a command
+#define CWS_RESPONSE_TIMEOUT_MS 2000 // budget to get the response to a command
+#define CWS_STATE_TIMEOUT_MS 20000   // budget to reach a state (except the end of the measure)
+#define CWS_RETRY_DELAY_MS 1000      // delay between retries
+#define CWS_READ_SLICE_MS 20         // serial reads are done in slices, checking for the prompt between them
+#define CWS_CYCLE_TIMEOUT_MIN (CWS_MEAS_TIMEOUT_MIN + 5) // budget of a cycle when there is no period
 
 #define PROMPT 1 // Wait for prompt
 #define NO_PROMPT 0 // Don't wait for the prompt
 
+#define CYCLE_ATTEMPTS 2 // attempts to complete a measurement cycle within its slot (recovering the link in between)
+#define HEALTH_REPLY_SAMPLES 48 // samples sent in the answer to the HEALTH command
+#define CYCLE_GRACE_SECS 1 // a cycle that used its whole budget may end this late without losing the next slot
+
 
 /*
  * ==================================================================
@@ -131,6 +168,7 @@ char** cws_get_substrings(char* buffer, const char* token, int* nStrings){
 		if (strlen(errmsg) > 0) { \
 			speLOG(LOG_ERR, errmsg);\
 		}  \
+		recorder_dump("%s failed at %s:%d", #func, __FILE__, __LINE__); \
 		return __temp_return; \
 	}\
 	__temp_return; \
@@ -138,32 +176,99 @@ char** cws_get_substrings(char* buffer, const char* token, int* nStrings){
 
 
 /*
- * Similar to TRY_CATCH but tries the same command several times with a delay between tries
+ * Tries func until it succeeds or the deadline budget is spent, with a delay
+ * between tries. func is evaluated on every try, so it can take a slice of
+ * the remaining budget (see deadline_sub). Returns the result of the last try
  * func: function
- * tries: tries
- * delayMs: delay (in Ms) between tries)
+ * deadline: deadline of the whole operation (evaluated once)
+ * delayMs: delay (in Ms) between tries
  * errmsg: error message to display
  */
-#define RETRIES(func, tries, delayMs, errmsg) ({ \
-		int __tries = tries; \
-		int __ret; \
-		while (__tries--) { \
-			__ret = func; \
-			if (__ret >= 0 ) { \
-				break;\
-			} \
-			if (strlen(errmsg) > 0) { \
-				speLOG(LOG_ERR, errmsg);\
-			}  \
-			cws_sleep(delayMs); \
+#define RETRIES(func, deadline, delayMs, errmsg) ({ \
+	int __ret; \
+	int __tries = 0; \
+	cws_deadline __deadline = (deadline); \
+	while (1) { \
+		TRACE_BEGIN("attempt", #func); \
+		__ret = func; \
+		TRACE_END("attempt", #func); \
+		__tries++; \
+		if (__ret >= 0) { \
+			break; \
+		} \
+		if (strlen(errmsg) > 0) { \
+			speLOG(LOG_ERR, errmsg); \
+		} \
+		if (deadline_left_ms(__deadline) <= delayMs) { \
+			recorder_dump("%s gave up after %d tries at %s:%d", #func, __tries, __FILE__, __LINE__); \
+			break; \
 		} \
-	if (__tries == 0){ \
-		return __ret; \
+		cws_sleep(delayMs); \
 	} \
 	__ret; \
 })
 
 
+/*
+ * Deadline msecs from now
+ */
+static cws_deadline deadline_in(int msecs){
+	return linux_get_monotonic_time() + ((double)msecs)/1000;
+}
+
+
+/*
+ * Deadline for a step of an operation: msecs from now, but never later than
+ * the deadline of the operation
+ */
+static cws_deadline deadline_sub(cws_deadline deadline, int msecs){
+	cws_deadline d = deadline_in(msecs);
+	return d < deadline ? d : deadline;
+}
+
+
+/*
+ * Milliseconds left until the deadline, 0 if expired
+ */
+static int deadline_left_ms(cws_deadline deadline){
+	double left = deadline - linux_get_monotonic_time();
+	return left > 0 ? (int)(1000*left) : 0;
+}
+
+
+/*
+ * msecs, or what is left until the deadline if it is shorter
+ */
+static int deadline_clamp_ms(cws_deadline deadline, int msecs){
+	int left = deadline_left_ms(deadline);
+	return left < msecs ? left : msecs;
+}
+
+
+
+/*
+ * Serial number of the sensor from the first field of a frame ("CWS10101")
+ */
+static uint32_t cws_parse_serial(const char* field){
+	return strtoul(field + strcspn(field, "0123456789"), NULL, 10);
+}
+
+
+/*
+ * Name of the trace file of a cycle: the first "%d" of the pattern is replaced
+ * by the cycle number, any other character is copied as is (the pattern comes
+ * from the command line, it is never used as a format)
+ */
+static void trace_file_name(char* name, int size, const char* pattern, int cycle){
+	const char* d = strstr(pattern, "%d");
+	if (d == NULL) {
+		snprintf(name, size, "%s", pattern);
+		return;
+	}
+	snprintf(name, size, "%.*s%d%s", (int)(d - pattern), pattern, cycle, d + 2);
+}
+
+
 
 /*
  * ==================================================================
@@ -173,16 +278,271 @@ char** cws_get_substrings(char* buffer, const char* token, int* nStrings){
  * ==================================================================
  */
 
-int main() {
+void usage(const char* name){
+	printf("usage: %s [-d device] [-b baudrate] [-n cycles] [-p period_secs] [-s socket] [-t trace] [-o history] [-m metrics] [-r comms] [-R cpu,priority] [-F] [-c checkpoint] [-H health]\n", name);
+	printf("       %s query [options] history... (see %s query -h)\n", name, name);
+	printf("       %s bench [options] (see %s bench -h)\n", name, name);
+	printf("   -d device       serial port (default /dev/ttyUSB0)\n");
+	printf("   -b baudrate     serial port baudrate (default 9600)\n");
+	printf("   -n cycles       number of measurement cycles, 0 runs forever (default 1)\n");
+	printf("   -p period_secs  time between the start of two cycles (default 0, back to back)\n");
+	printf("   -s socket       path of the control socket (default none)\n");
+	printf("   -t trace        dump the timeline of every cycle to this file in Chrome trace-event\n");
+	printf("                   format, a %%d in the name is replaced by the cycle number (default none)\n");
+	printf("   -o history      append the samples to this history file (default none)\n");
+	printf("   -m metrics      write the driver statistics to this file after every cycle (default none)\n");
+	printf("   -r comms        prefix of the comms flight recorder dumps (default /tmp/cws_comms)\n");
+	printf("   -R cpu,priority real-time mode: pin to cpu (-1 any), SCHED_FIFO priority (1-99) and lock memory\n");
+	printf("   -F              framing mode, the tty line discipline delimits the sensor frames\n");
+	printf("   -c checkpoint   save the phase of the cycle to this file and resume from it on restart (default none)\n");
+	printf("   -H health       append the sensor health of every status poll to this CSV file (default none)\n");
+}
+
+
+/*
+ * Performs a full measurement cycle. If the cycle fails the link watchdog tries
+ * to recover the connection and the cycle is attempted again, so a glitch in
+ * the serial link does not cost the whole measurement slot. No attempt is
+ * started once the deadline has passed
+ */
+int run_cycle(LibSensor* self, int* initialized, cws_deadline deadline){
+	int attempt;
+	int ret = -1;
+	TRACE_BEGIN("cycle", NULL);
+	if (self->ckpt.phase == CKPT_NONE) {
+		checkpoint_enter(&self->ckpt, CKPT_INIT, self->state);
+	}
+	for (attempt = 0 ; attempt < CYCLE_ATTEMPTS ; attempt++) {
+		if (self->fd > 0) {
+			// a cycle past START is resumed, stopping the sensor would lose the measurement
+			if (!*initialized) {
+				int r = (self->ckpt.phase >= CKPT_MEASURING) ? sensor_resume(self, deadline) : sensor_init(self, deadline);
+				if (r >= 0) {
+					*initialized = 1;
+				}
+			}
+			if (*initialized && sensor_measure(self, deadline) >= 0) {
+				ret = 0;
+				break;
+			}
+		}
+		*initialized = 0;  // sensor state unknown after a failure
+		if (deadline_left_ms(deadline) <= 0) {
+			speLOG(LOG_WARNING, "Measurement cycle failed, no time left in its slot");
+			break;
+		}
+		speLOG(LOG_WARNING, "Measurement cycle failed (attempt %d of %d), recovering link", attempt + 1, CYCLE_ATTEMPTS);
+		if (cws_recover_link(self, deadline) < 0) {
+			break;
+		}
+	}
+	TRACE_END("cycle", NULL);
+	return ret;
+}
+
+
+int main(int argc, char** argv) {
+	if (argc > 1 && !strcmp(argv[1], "query")) {
+		return query_main(argc - 1, argv + 1);
+	}
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		return bench_main(argc - 1, argv + 1);
+	}
 	speLOG(LOG_INFO, "=== Start CWS 10101 Driver ===");
 	char device[256] = "/dev/ttyUSB0";
 	int baudrate = 9600;
+	int cycles = 1;
+	int period = 0;
+	int opt;
+	int initialized = 0;
+	int ret = 0;
+	int i;
+
+	char* socket_path = NULL;
+	char* trace_path = NULL;
+	char* history_path = NULL;
+	char* metrics_path = NULL;
+	char* recorder_prefix = NULL;
+	char* checkpoint_path = NULL;
+	char* health_path = NULL;
+	int rt_cpu = -1;
+	int rt_priority = 0;
+
+	while ((opt = getopt(argc, argv, "d:b:n:p:s:t:o:m:r:R:Fc:H:h")) != -1) {
+		switch (opt) {
+			case 'd':
+				strncpy(device, optarg, sizeof(device) - 1);
+				break;
+			case 'b':
+				baudrate = atoi(optarg);
+				break;
+			case 'n':
+				cycles = atoi(optarg);
+				break;
+			case 'p':
+				period = atoi(optarg);
+				break;
+			case 's':
+				socket_path = optarg;
+				break;
+			case 't':
+				trace_path = optarg;
+				break;
+			case 'o':
+				history_path = optarg;
+				break;
+			case 'm':
+				metrics_path = optarg;
+				break;
+			case 'r':
+				recorder_prefix = optarg;
+				break;
+			case 'c':
+				checkpoint_path = optarg;
+				break;
+			case 'H':
+				health_path = optarg;
+				break;
+			case 'F':
+				linux_uart_set_framing(1);
+				break;
+			case 'R':
+				if (sscanf(optarg, "%d,%d", &rt_cpu, &rt_priority) != 2 || rt_priority < 1 || rt_priority > 99) {
+					speLOG(LOG_ERR, "real-time mode expects cpu,priority (priority 1 to 99)");
+					return -1;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : -1;
+		}
+	}
 
 	LibSensor self;
+	memset(&self, 0, sizeof(self));
+	strcpy(self.device, device);
+	self.baudrate = baudrate;
+	wd_init(&self.wd, device);
+	recorder_init(recorder_prefix, device);
+	if (rt_priority > 0) {
+		cws_histogram before, after;
+		rt_probe_latency(&before);
+		rt_enable(rt_cpu, rt_priority);
+		rt_probe_latency(&after);
+		speLOG(LOG_INFO, "wakeup latency p50/p99/max: %.3f/%.3f/%.3f ms before, %.3f/%.3f/%.3f ms in real-time mode",
+				hist_percentile(&before, 50), hist_percentile(&before, 99), before.max_ms,
+				hist_percentile(&after, 50), hist_percentile(&after, 99), after.max_ms);
+	}
+	if (socket_path != NULL && ctl_open(socket_path) < 0) {
+		return -1;
+	}
+	// the sensor id of the events is set from the first frame received
+	if (trace_path != NULL && trace_init(0, device) < 0) {
+		return -1;
+	}
+	if (history_path != NULL && history_open(history_path) < 0) {
+		return -1;
+	}
+	if (health_path != NULL && health_open_log(health_path) < 0) {
+		return -1;
+	}
+	if (checkpoint_path != NULL) {
+		int phase = checkpoint_open(checkpoint_path, &self.ckpt);
+		double now = linux_get_epoch_time();
+		if (phase < CKPT_MEASURING) {
+			self.ckpt.phase = CKPT_NONE;
+		}
+		else if ((phase == CKPT_MEASURING && now > self.ckpt.measure_start + 60*CWS_MEAS_TIMEOUT_MIN) ||
+				now > self.ckpt.cycle_start + 60*CWS_CYCLE_TIMEOUT_MIN) {
+			speLOG(LOG_WARNING, "Checkpoint of a cycle at phase %s is too old, starting a new cycle", ckpt_phase_str[phase]);
+			self.ckpt.phase = CKPT_NONE;
+		} else {
+			speLOG(LOG_INFO, "Previous run was interrupted at phase %s, resuming", ckpt_phase_str[phase]);
+		}
+	}
+	pthread_mutex_init(&self.sample_lock, NULL);
+	pthread_mutex_init(&self.process_lock, NULL);
+	if (pipeline_open(cws_process_sample, &self) < 0) {
+		speLOG(LOG_ERR, "sample pipeline not running, every sample will be processed inline");
+	}
+
 	self.fd = les_open_serial_port(device, baudrate);
-	TRY_CATCH(sensor_init(&self), "ERROR Could not initialize sensor!");
-	TRY_CATCH(sensor_measure(&self), "ERROR, could not get measure!");
-	return 0;
+	if (self.fd < 0) {
+		speLOG(LOG_WARNING, "Could not open %s, waiting for the device", device);
+	}
+
+	double next_slot = linux_get_monotonic_time();
+	for (i = 0 ; cycles == 0 || i < cycles ; i++) {
+		ctl_measure_requested(1); // this cycle serves any pending trigger
+		// the cycle must be over before the next slot starts
+		cws_deadline deadline = next_slot + (period > 0 ? period : 60*CWS_CYCLE_TIMEOUT_MIN);
+		double cycle_start = linux_get_monotonic_time();
+		ret = run_cycle(&self, &initialized, deadline);
+		speLOG(LOG_DETAIL, "cycle took %.1f s (budget %.1f s)", linux_get_monotonic_time() - cycle_start, deadline - cycle_start);
+		self.cycles++;
+		if (ret < 0) {
+			speLOG(LOG_ERR, "ERROR, could not get measure!");
+			self.cycles_failed++;
+			checkpoint_enter(&self.ckpt, CKPT_NONE, self.state);
+		}
+		if (self.fd > 0) {
+			linux_uart_update_rates(self.fd); // the rates reported until the next cycle are the ones of this one
+		}
+		cws_log_link_stats(&self);
+		recorder_poll();
+		if (metrics_path != NULL) {
+			cws_write_stats(&self, metrics_path);
+		}
+		if (trace_path != NULL) {
+			char trace_file[512];
+			trace_file_name(trace_file, sizeof(trace_file), trace_path, i);
+			trace_dump(trace_file);
+			trace_reset();
+		}
+		if (cycles > 0 && i + 1 >= cycles) {
+			break;
+		}
+		// Keep the schedule: next slot is relative to the start of this one
+		double now = linux_get_monotonic_time();
+		if (period <= 0) {
+			next_slot = now;
+			continue;
+		}
+		next_slot += period;
+		while (next_slot + CYCLE_GRACE_SECS < now) {
+			speLOG(LOG_WARNING, "Cycle overran its slot, skipping to the next one");
+			next_slot += period;
+			self.cycles_missed++;
+		}
+		// Wait for the next slot serving the control socket, a MEASURE request starts a cycle right away
+		while (now < next_slot && !ctl_measure_requested(0)) {
+			int wait_ms = (int)(1000*(next_slot - now));
+			cws_idle(&self, wait_ms < 1000 ? wait_ms : 1000, next_slot);
+			now = linux_get_monotonic_time();
+		}
+		if (ctl_measure_requested(0)) {
+			speLOG(LOG_INFO, "Measurement requested through the control socket");
+			next_slot = now;
+		}
+	}
+
+	if (self.wd.recoveries[WD_STEP_PROBE] + self.wd.recoveries[WD_STEP_BREAK] +
+			self.wd.recoveries[WD_STEP_MODEM_LINES] + self.wd.recoveries[WD_STEP_REOPEN] +
+			self.wd.recoveries[WD_STEP_FAILED] > 0) {
+		speLOG(LOG_INFO, "Link recoveries: probe %d, break %d, DTR/RTS %d, reopen %d, failed %d (max %.1f ms, total %.1f ms)",
+				self.wd.recoveries[WD_STEP_PROBE], self.wd.recoveries[WD_STEP_BREAK],
+				self.wd.recoveries[WD_STEP_MODEM_LINES], self.wd.recoveries[WD_STEP_REOPEN],
+				self.wd.recoveries[WD_STEP_FAILED], self.wd.max_recovery_ms, self.wd.total_recovery_ms);
+	}
+	pipeline_close(); // stores the samples still in the queue
+	wd_close(&self.wd);
+	ctl_close();
+	history_close();
+	health_close_log();
+	if (self.fd > 0) {
+		linux_close_uart(self.fd);
+	}
+	return ret;
 }
 
 
@@ -197,12 +557,12 @@ int main() {
 
 
 /*
- * Tries to get the sensor prompt "WETCHEM>"
- * If after 3 opportunities it fails, an error is thrown
- * returns 1 on exit -1 on failure
+ * Reads from the sensor until the prompt "WETCHEM>" is at the end of the
+ * received data or the deadline expires
+ * returns 0 on success -1 on failure
  *
  */
-int cws_get_prompt(LibSensor* self){
+int cws_get_prompt(LibSensor* self, cws_deadline deadline){
 	char buff[256];
 	int indx = 0;
 	int n = 0;
@@ -210,121 +570,420 @@ int cws_get_prompt(LibSensor* self){
 	int prompt_length =  strlen("WETCHEM>");
 
 	memset(buff, 0, 256);
-	n = les_read(self->fd, 200, &buff[indx], 200);
-	indx += n;
+	do {
+		// in framing mode reads return at the end of a frame, no need to slice the wait
+		int slice = deadline_left_ms(deadline);
+		if (!linux_uart_framed(self->fd) && slice > CWS_READ_SLICE_MS) {
+			slice = CWS_READ_SLICE_MS;
+		}
+		if (indx >= (int)sizeof(buff) - 1) {
+			// keep the tail, the prompt is at the end
+			memmove(buff, &buff[indx - prompt_length], prompt_length);
+			indx = prompt_length;
+		}
+		n = les_read(self->fd, slice, &buff[indx], sizeof(buff) - 1 - indx);
+		if (n < 0) {
+			wd_report(&self->wd, WD_EV_READ_ERROR);
+			return -1;
+		}
+		indx += n;
 
+		//Compare last bytes of the buffer, prompt should be at the end
+		if (indx >= prompt_length && !memcmp(prompt, &buff[indx - prompt_length], prompt_length)) {
 #ifdef CWS_DEBUG_COMMS
-	/*
-	char temp[50];
-	temp[prompt_length] = 0;
-	speLOG(LOG_DETAIL, "buff: [%s]", buff);
-	memcpy(temp, &buff[indx - prompt_length], prompt_length);
-	speLOG(LOG_DETAIL, "    comparing buff: '%s'", prompt);
-	speLOG(LOG_DETAIL, "    with prompt   : '%s'", &buff[indx - prompt_length]);
-	*/
+			speLOG(LOG_DETAIL, "PROMPT FOUND!!!");
 #endif
-	//Compare last bytes of the buffer, prompt should be at the end
-	if (!memcmp(prompt, &buff[indx - prompt_length], prompt_length)) {
-#ifdef CWS_DEBUG_COMMS
-	//speLOG(LOG_DETAIL, "PROMPT FOUND!!!");
-#endif
-		return 0;
-	}
+			return 0;
+		}
+	} while (deadline_left_ms(deadline) > 0);
 
 	return -1;
 }
 
 
 /*
- * Wrapper for sleep
+ * Checks if the sensor is alive by sending an empty line and waiting for the
+ * prompt. Used by the link watchdog after every recovery step.
+ */
+int cws_probe_link(void* arg, double deadline){
+	LibSensor* self = (LibSensor*)arg;
+	int tries = 3;
+	if (self->fd <= 0) {
+		return -1;
+	}
+	les_resetRxFifo(self->fd);
+	while (tries-- > 0 && deadline_left_ms(deadline) > 0) {
+		if (les_writeLine(self->fd, 200, "\r\n") < 0) {
+			return -1;
+		}
+		if (cws_get_prompt(self, deadline_sub(deadline, 500)) >= 0) {
+			wd_report(&self->wd, WD_EV_OK);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+/*
+ * Runs the link watchdog recovery within the deadline. Returns the step that
+ * recovered the link or -1
+ */
+int cws_recover_link(LibSensor* self, cws_deadline deadline){
+	int step;
+	TRACE_BEGIN("recover", NULL);
+	step = wd_recover(&self->wd, &self->fd, self->baudrate, cws_probe_link, self, deadline);
+	TRACE_END("recover", step >= 0 ? wd_step_str[step] : "failed");
+	return step;
+}
+
+
+/*
+ * Wrapper for sleep, records how late it wakes up
  */
 int cws_sleep(int msecs) {
-	return usleep(1000*msecs);
+	int r;
+	double end = linux_get_monotonic_time() + ((double)msecs)/1000;
+	TRACE_BEGIN("sleep", NULL);
+	r = usleep(1000*msecs);
+	TRACE_END("sleep", NULL);
+	hist_add(&rt_wakeup, 1000*(linux_get_monotonic_time() - end));
+	return r;
+}
+
+
+/*
+ * Writes the driver statistics as "key value" lines into buff
+ */
+int cws_format_stats(LibSensor* self, char* buff, int size){
+	cws_watchdog* wd = &self->wd;
+	linux_uart_stats uart;
+	unsigned long frames = self->frames_ok + self->frames_bad;
+	int n;
+
+	n = snprintf(buff, size,
+			"link_failures %d\nlink_timeouts %d\nlink_read_errors %d\n"
+			"recoveries_probe %d\nrecoveries_break %d\nrecoveries_modem_lines %d\n"
+			"recoveries_reopen %d\nrecoveries_failed %d\n"
+			"recovery_last_ms %.1f\nrecovery_max_ms %.1f\nrecovery_total_ms %.1f\n"
+			"frames_ok %lu\nframes_bad %lu\nframes_bad_ratio %.4f\n",
+			wd->failures, wd->timeouts, wd->read_errors,
+			wd->recoveries[WD_STEP_PROBE], wd->recoveries[WD_STEP_BREAK], wd->recoveries[WD_STEP_MODEM_LINES],
+			wd->recoveries[WD_STEP_REOPEN], wd->recoveries[WD_STEP_FAILED],
+			wd->last_recovery_ms, wd->max_recovery_ms, wd->total_recovery_ms,
+			self->frames_ok, self->frames_bad, frames > 0 ? ((double)self->frames_bad)/frames : 0.0);
+
+	if (n < size) {
+		n += snprintf(buff + n, size - n,
+				"cycles %lu\ncycles_failed %lu\ncycles_missed %lu\n"
+				"rtt_count %lu\nrtt_mean_ms %.2f\nrtt_p50_ms %.2f\nrtt_p99_ms %.2f\nrtt_max_ms %.2f\nrtt_hist ",
+				self->cycles, self->cycles_failed, self->cycles_missed,
+				self->rtt.count, self->rtt.count > 0 ? self->rtt.sum_ms/self->rtt.count : 0.0,
+				hist_percentile(&self->rtt, 50), hist_percentile(&self->rtt, 99), self->rtt.max_ms);
+	}
+	if (n < size) {
+		n += hist_format(&self->rtt, buff + n, size - n);
+	}
+	if (n < size) {
+		n += snprintf(buff + n, size - n, "\nwakeup_late_p50_ms %.3f\nwakeup_late_p99_ms %.3f\nwakeup_late_max_ms %.3f\n",
+				hist_percentile(&rt_wakeup, 50), hist_percentile(&rt_wakeup, 99), rt_wakeup.max_ms);
+	}
+
+	if (n < size) {
+		n += health_format_stats(&self->health, buff + n, size - n);
+	}
+	if (n < size) {
+		pipeline_stats pipe;
+		pipeline_get_stats(&pipe);
+		n += snprintf(buff + n, size - n,
+				"pipeline_depth %d\npipeline_depth_max %d\npipeline_submitted %lu\npipeline_processed %lu\n"
+				"pipeline_waits %lu\npipeline_timeouts %lu\n",
+				pipe.depth, pipe.depth_max, pipe.submitted, pipe.processed, pipe.waits, pipe.timeouts);
+	}
+
+	if (n < size && self->fd > 0 && linux_uart_get_stats(self->fd, &uart) == 0) {
+		n += snprintf(buff + n, size - n,
+				"uart_rx_bytes %lu\nuart_tx_bytes %lu\nuart_rx_rate %.1f\nuart_tx_rate %.1f\n"
+				"uart_read_errors %lu\nuart_rx_backlog_max %d\n"
+				"uart_read_calls %lu\nuart_wakeups %lu\nuart_reads_per_response %.2f\n",
+				uart.rx_bytes, uart.tx_bytes, uart.rx_rate, uart.tx_rate,
+				uart.read_errors, uart.rx_backlog_max,
+				uart.read_calls, uart.wakeups, self->rtt.count > 0 ? ((double)uart.read_calls)/self->rtt.count : 0.0);
+		if (n < size && uart.icount_valid) {
+			n += snprintf(buff + n, size - n,
+					"uart_frame_errors %d\nuart_overruns %d\nuart_parity_errors %d\n"
+					"uart_breaks %d\nuart_buffer_overruns %d\n",
+					uart.frame, uart.overrun, uart.parity, uart.brk, uart.buf_overrun);
+		}
+	}
+	return n;
+}
+
+
+/*
+ * Writes the driver statistics to a file, replacing it atomically so readers
+ * never see a partial file
+ */
+int cws_write_stats(LibSensor* self, const char* path){
+	char stats[4096];
+	char tmp[512];
+	FILE* f;
+
+	cws_format_stats(self, stats, sizeof(stats));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		speLOG(LOG_ERR, "could not write metrics file %s", path);
+		return -1;
+	}
+	fputs(stats, f);
+	fclose(f);
+	return rename(tmp, path);
+}
+
+
+/*
+ * Logs a summary of the serial link statistics
+ */
+void cws_log_link_stats(LibSensor* self){
+	linux_uart_stats uart;
+	if (self->fd <= 0 || linux_uart_get_stats(self->fd, &uart) < 0) {
+		return;
+	}
+	speLOG(LOG_DETAIL, "link: rx %lu B (%.1f B/s), tx %lu B (%.1f B/s), backlog max %d B, bad frames %lu of %lu",
+			uart.rx_bytes, uart.rx_rate, uart.tx_bytes, uart.tx_rate, uart.rx_backlog_max,
+			self->frames_bad, self->frames_ok + self->frames_bad);
+	if (uart.icount_valid && (uart.frame || uart.overrun || uart.parity || uart.buf_overrun)) {
+		speLOG(LOG_WARNING, "link errors: framing %d, overrun %d, parity %d, buffer overrun %d",
+				uart.frame, uart.overrun, uart.parity, uart.buf_overrun);
+	}
+}
+
+
+/*
+ * Answers the pending requests of the control socket. Status requests are
+ * answered from the last state received if it is recent enough, otherwise a
+ * single GETSTATUS is sent for all of them, within the deadline of the caller
+ */
+int cws_serve_control(LibSensor* self, int req, cws_deadline deadline){
+	if (req & CTL_REQ_STATUS) {
+		cws_state s;
+		double age = linux_get_monotonic_time() - self->state_time;
+		if (self->state_time <= 0 || age*1000 > CTL_STATUS_TTL_MS) {
+			if (cws_get_state(self, &s, deadline_sub(deadline, CWS_RESPONSE_TIMEOUT_MS)) < 0) {
+				ctl_reply(CTL_REQ_STATUS, "ERROR could not get state\n");
+				req &= ~CTL_REQ_STATUS;
+			}
+			age = linux_get_monotonic_time() - self->state_time;
+		}
+		if (req & CTL_REQ_STATUS) {
+			ctl_reply(CTL_REQ_STATUS, "%s age %.1f s\n", cws_states_str[self->state], age);
+		}
+	}
+	if (req & CTL_REQ_LAST) {
+		pthread_mutex_lock(&self->sample_lock);
+		if (self->last_sample_time > 0) {
+			ctl_reply(CTL_REQ_LAST, "%s age %.0f s\n", self->last_sample,
+					linux_get_epoch_time() - self->last_sample_time);
+		} else {
+			ctl_reply(CTL_REQ_LAST, "ERROR no sample yet\n");
+		}
+		pthread_mutex_unlock(&self->sample_lock);
+	}
+	if (req & CTL_REQ_HEALTH) {
+		char series[4096];
+		health_format_series(&self->health, HEALTH_REPLY_SAMPLES, series, sizeof(series));
+		ctl_reply(CTL_REQ_HEALTH, "%s", series);
+	}
+	if (req & CTL_REQ_STATS) {
+		char stats[4096];
+		cws_format_stats(self, stats, sizeof(stats));
+		ctl_reply(CTL_REQ_STATS, "%s", stats);
+	}
+	return 0;
 }
 
 
 /*
- * Gets the sensor current state by using the command
+ * Like cws_sleep, but serving the control socket while waiting. Must only be
+ * called between serial transactions, as serving a request may talk to the
+ * sensor, which is done within the deadline of the caller
+ */
+int cws_idle(LibSensor* self, int msecs, cws_deadline deadline) {
+	double end = linux_get_monotonic_time() + ((double)msecs)/1000;
+	double now;
+	int req = 0;
+	TRACE_BEGIN("idle", NULL);
+	while ((now = linux_get_monotonic_time()) < end) {
+		req = ctl_poll((int)(1000*(end - now)));
+		recorder_poll();
+		if (req) {
+			TRACE_BEGIN("control", NULL);
+			cws_serve_control(self, req, deadline);
+			TRACE_END("control", NULL);
+		}
+	}
+	if (!req) {
+		hist_add(&rt_wakeup, 1000*(now - end)); // timed out, not woken by a request
+	}
+	TRACE_END("idle", NULL);
+	return 0;
+}
+
+
+/*
+ * Sends a command to the sensor
  *  self: LibSensor
  *  cmd: command to send (without \r\n)
  *  prompt: if > 0 after sending the command we will wait for the prompt
+ *  deadline: the prompt must arrive before it
  */
 
-int cws_send_command(LibSensor* self, char* cmd, int prompt) {
+static int cws_do_send_command(LibSensor* self, char* cmd, int prompt, cws_deadline deadline) {
 	int r;
 	char buff[strlen(cmd) + 4];
+
+	// Recover the link as soon as the watchdog finds it dead, within the budget
+	// of the command, fail fast if it can't be recovered
+	if (wd_link_dead(&self->wd)) {
+		speLOG(LOG_WARNING, "Link dead, recovering before sending %s", cmd);
+		if (cws_recover_link(self, deadline) < 0) {
+			speLOG(LOG_ERR, "Link dead, not sending %s", cmd);
+			return -1;
+		}
+	}
 	sprintf(buff, "%s\r\n", cmd);
+	self->last_tx_time = linux_get_monotonic_time();
 	r = les_writeLine(self->fd, 200, buff);
 #ifdef CWS_DEBUG_COMMS
 	speLOG(LOG_DETAIL, "   TX [%s]", cmd);
 #endif
+	if (r < 0) {
+		wd_report(&self->wd, WD_EV_READ_ERROR);
+		return -1;
+	}
 
 	if (prompt) {
-		RETRIES(cws_get_prompt(self), 5, 1000, "");
+		if (cws_get_prompt(self, deadline) < 0) {
+			wd_report(&self->wd, WD_EV_TIMEOUT);
+			return -1;
+		}
+		hist_add(&self->rtt, 1000*(linux_get_monotonic_time() - self->last_tx_time));
+		wd_report(&self->wd, WD_EV_OK);
 	}
 
 	return r;
 }
 
+int cws_send_command(LibSensor* self, char* cmd, int prompt, cws_deadline deadline) {
+	int r;
+	TRACE_BEGIN("command", cmd);
+	r = cws_do_send_command(self, cmd, prompt, deadline);
+	TRACE_END("command", cmd);
+	return r;
+}
+
 /*
- * Reads the response of the sensor, until a new prompt is found. Return the string until the prompt
+ * Reads the response of the sensor, until a new prompt is found or the
+ * deadline expires. The bytes are read straight into response (for samples,
+ * a pipeline slot), which is left with the string until the prompt
  */
-int cws_get_response(LibSensor* self, char* response, int respsize, int timeoutMs) {
+int cws_get_response(LibSensor* self, char* response, int respsize, cws_deadline deadline) {
 
-	char buff[respsize];
 	int indx = 0;
-	int trials = 3;
 	int n = 0;
 	char prompt[20] =  "WETCHEM>";
 	int prompt_length =  strlen("WETCHEM>");
-	memset(buff, 0, respsize);
+	memset(response, 0, respsize);
 
-	while (trials-- > 0) {
-		n = les_read(self->fd, timeoutMs, &buff[indx], respsize);
+	do {
+		// in framing mode reads return at the end of a frame, no need to slice the wait
+		int slice = deadline_left_ms(deadline);
+		if (!linux_uart_framed(self->fd) && slice > CWS_READ_SLICE_MS) {
+			slice = CWS_READ_SLICE_MS;
+		}
+		n = les_read(self->fd, slice, &response[indx], respsize - indx - 1);
+		if (n < 0) {
+			wd_report(&self->wd, WD_EV_READ_ERROR);
+			return -1;
+		}
 		indx += n;
 
 		if (indx < prompt_length) {
-			//speLOG(LOG_DEBUG, "   read %d bytes, but no prompt yet [%s]", indx, buff);
+			//speLOG(LOG_DEBUG, "   read %d bytes, but no prompt yet [%s]", indx, response);
 		}
 		// Compare last bytes of the buffer, prompt should be at the end
-		else if (!memcmp(prompt, &buff[indx - prompt_length], prompt_length)) {
-			//speLOG(LOG_DEBUG,"showing buffer (n=%d):\n", indx);
-
-			int length = indx-prompt_length;
-			if (length < respsize) {
-				length = respsize;
-			}
-
-			memcpy(response, &buff, indx - prompt_length);
+		else if (!memcmp(prompt, &response[indx - prompt_length], prompt_length)) {
+			int length = indx - prompt_length;
+			response[length] = 0;
 
 			// in case it ends with \r\n shorten it to erase the newlines
-			if (response[indx - prompt_length - 2] == '\r') {
-				response[indx - prompt_length - 2] = 0;
+			if (length >= 2 && response[length - 2] == '\r') {
+				response[length - 2] = 0;
 			}
-
+#ifdef CWS_DEBUG_COMMS
+			speLOG(LOG_DETAIL, "   RX [%s]", response);
+#endif
+			hist_add(&self->rtt, 1000*(linux_get_monotonic_time() - self->last_tx_time));
+			wd_report(&self->wd, WD_EV_OK);
 			return indx;
 		}
-		cws_sleep(timeoutMs);
-	}
+		if (indx >= respsize - 1) {
+			break; // full buffer without prompt, garbage
+		}
+	} while (deadline_left_ms(deadline) > 0);
 
-	if (trials == 0){
-		return -1;
-	}
+	wd_report(&self->wd, WD_EV_TIMEOUT);
+	return -1;
+}
 
-#ifdef CWS_DEBUG_COMMS
-	speLOG(LOG_DETAIL, "   RX [%s]", response);
-#endif
 
-	return strlen(response);
+/*
+ * Sends GETSTATUS and reads the response
+ */
+static int cws_query_status(LibSensor* self, char* resp, int respsize, cws_deadline deadline){
+	les_resetRxFifo(self->fd);
+	if (cws_send_command(self, "GETSTATUS", NO_PROMPT, deadline) < 0) {
+		return -1;
+	}
+	return cws_get_response(self, resp, respsize, deadline);
 }
 
 
+/*
+ * Keeps the health fields of a status reply (already split):
+ * "CWS10101,4,1691166748,1691166748,11.5,27.8,IDLE,0"
+ *  2 -> sensor epoch
+ *  4 -> supply voltage
+ *  5 -> internal temp
+ *  7 -> error code
+ * The sensor clock has 1 s resolution, the offset is computed against the
+ * host time in the middle of the round trip, assuming the sensor time is
+ * in the middle of its second
+ */
+static void cws_record_health(LibSensor* self, char** splits, cws_state state){
+	health_sample s;
+	double rtt = linux_get_monotonic_time() - self->last_tx_time;
+	int prev_error = self->health.count > 0 ? self->health.samples[(self->health.count - 1) % HEALTH_SAMPLES].error : 0;
+
+	s.time = linux_get_epoch_time();
+	s.clock_offset = strtod(splits[2], NULL) + 0.5 - (s.time - rtt/2);
+	s.voltage = strtod(splits[4], NULL);
+	s.internal_temp = strtod(splits[5], NULL);
+	s.error = atoi(splits[7]);
+	s.state = state;
+	if (s.error != prev_error) {
+		speLOG(s.error ? LOG_WARNING : LOG_INFO, "sensor error code %d (was %d)", s.error, prev_error);
+	}
+	health_add(&self->health, &s);
+}
 
 
-int cws_get_state(LibSensor *self, cws_state* state){
+int cws_get_state(LibSensor *self, cws_state* state, cws_deadline deadline){
 	char resp[256];
 	char *state_str;
 	int nbytes;
+	cws_deadline poll_deadline;
 
 	char **splits;
 	int nsplits;
@@ -332,10 +991,11 @@ int cws_get_state(LibSensor *self, cws_state* state){
 	*state = UNKNOWN;
 
 	memset(resp, 0, 256);
-	les_resetRxFifo(self->fd);
-
-	cws_send_command(self, "GETSTATUS", NO_PROMPT);
-	nbytes = TRY_CATCH(cws_get_response(self, resp, 256, 2000), "Could not get response");
+	// the deadline may be the whole measurement while waiting for IDLE, a sensor
+	// that doesn't answer a poll for longer than this gives the cycle back
+	poll_deadline = deadline_sub(deadline, CWS_STATE_TIMEOUT_MS);
+	nbytes = TRY_CATCH(RETRIES(cws_query_status(self, resp, 256, deadline_sub(poll_deadline, CWS_RESPONSE_TIMEOUT_MS)),
+			poll_deadline, CWS_RETRY_DELAY_MS, "Could not get response"), "Could not get state");
 
 	if (nbytes < 1 ){
 		speLOG(LOG_ERR, "empty buffer");
@@ -352,6 +1012,9 @@ int cws_get_state(LibSensor *self, cws_state* state){
 
 	if (nsplits != 8) {
 		speLOG(LOG_ERR, "Could not parse response! expcted 8 fields, got %d", nsplits);
+		__atomic_add_fetch(&self->frames_bad, 1, __ATOMIC_RELAXED);
+		recorder_dump("could not parse status, %d fields", nsplits);
+		fastFree(splits);
 		return -1;
 	}
 	state_str = splits[6];  // The state should be the 6th string (starting from 0)
@@ -366,44 +1029,67 @@ int cws_get_state(LibSensor *self, cws_state* state){
 		*state = SLEEPING;
 	} else {
 		speLOG(LOG_ERR, "Unrecognized CWS state '%s'", state_str);
+		__atomic_add_fetch(&self->frames_bad, 1, __ATOMIC_RELAXED);
+		recorder_dump("unrecognized state '%s'", state_str);
 		fastFree(splits);
 		*state = UNKNOWN;
 		return -1;
 	}
 
+	cws_record_health(self, splits, *state);
+	trace_set_sensor(cws_parse_serial(splits[0]));
 	fastFree(splits);
+	__atomic_add_fetch(&self->frames_ok, 1, __ATOMIC_RELAXED);
+	self->state = *state;
+	self->state_time = linux_get_monotonic_time();
 	return 0;
 }
 
 /*
- * Waits until the sensor reached the desired state or until timeout expires.
- * If Timeout expires, return -1, otherwise 0.
+ * Waits until the sensor reached the desired state or until the deadline
+ * expires. If the deadline expires, return -1, otherwise 0.
  */
-int cws_wait_until_state(LibSensor* self, cws_state target_state, int timeoutMs) {
-	// TODO apply the timeout!
+int cws_wait_until_state(LibSensor* self, cws_state target_state, cws_deadline deadline) {
 	cws_state s = UNKNOWN;
-	long int time = 0;
 	int ret;
+	TRACE_BEGIN("wait_state", cws_states_str[target_state]);
 	while (s != target_state) {
-		ret = cws_get_state(self, &s);
+		TRACE_BEGIN("poll_state", NULL);
+		ret = cws_get_state(self, &s, deadline);
+		TRACE_END("poll_state", cws_states_str[s]);
 		if (ret < 0) {
 			speLOG(LOG_DEBUG, "Can't get state!");
+			TRACE_END("wait_state", "error");
 			return -1;
 		}
 		if (s != target_state) {
-			cws_sleep(1000);
-			time += 1000;
-			if (time > timeoutMs) {
+			int left = deadline_left_ms(deadline);
+			if (left <= 0) {
 				speLOG(LOG_ERR,"Timeout error!");
+				TRACE_END("wait_state", "timeout");
 				return -1;
 			}
+			cws_idle(self, left < 1000 ? left : 1000, deadline);
 		}
 	}
+	TRACE_END("wait_state", cws_states_str[target_state]);
 	return 0;
 }
 
 
 
+/*
+ * Sends GETSAMPLE and reads the response
+ */
+static int cws_request_sample(LibSensor* self, char* resp, int respsize, cws_deadline deadline){
+	les_resetRxFifo(self->fd);
+	if (cws_send_command(self, "GETSAMPLE", NO_PROMPT, deadline) < 0) {
+		return -1;
+	}
+	return cws_get_response(self, resp, respsize, deadline);
+}
+
+
 /*
  * Gets a sample from the sensor. The sample frame looks like:
  * 'CWS10101,4,1691166748,8.123,20.0,0.1234,1.1234,2.1234,11.5,27.8'
@@ -421,38 +1107,97 @@ int cws_wait_until_state(LibSensor* self, cws_state target_state, int timeoutMs)
  * 9->internal temp
  *
  */
-int cws_get_sample(LibSensor* self ){
-	char buff[256];
-	char **strings;
-	int nstrings;
-	strings = fastMalloc(30*sizeof(char*));
+int cws_get_sample(LibSensor* self, cws_deadline deadline){
+	char local[PIPELINE_FRAME_SIZE];
+	char* buff;
+	int r;
 	speLOG(LOG_INFO, "getting sample...");
 
-	TRY_CATCH(cws_send_command(self, "GETSAMPLE", NO_PROMPT), "could not send getsample command");
-
-
+	// read the frame straight into a pipeline slot, if the worker is too far
+	// behind to free one in time it's processed here (after the frame the
+	// worker is processing, see cws_process_sample)
+	buff = pipeline_acquire(deadline_sub(deadline, CWS_RESPONSE_TIMEOUT_MS));
+	if (buff == NULL) {
+		speLOG(LOG_WARNING, "sample pipeline full, processing the sample inline");
+		buff = local;
+	}
 
 #ifdef SIMULATE_RESPONSE
 	// TODO: Forcing response!!!
 	strcpy(buff, "CWS10101,4,1691166748,8.123,20.0,0.1234,1.1234,2.1234,11.5,27.8");
+	r = 0;
 #else
-	RETRIES(cws_get_response(self, buff, 256, 2000), 3, 1000, "Could not get response");
+	r = RETRIES(cws_request_sample(self, buff, PIPELINE_FRAME_SIZE, deadline_sub(deadline, CWS_RESPONSE_TIMEOUT_MS)),
+			deadline, CWS_RETRY_DELAY_MS, "Could not get response");
 #endif
+	if (r < 0) {
+		if (buff != local) {
+			pipeline_release(buff);
+		}
+		speLOG(LOG_ERR, "could not get sample");
+		return -1;
+	}
+
+	if (buff == local) {
+		cws_process_sample(buff, self);
+	} else {
+		pipeline_submit(buff);
+	}
+	return 0;
+}
+
+
+/*
+ * Post-processing of a sample frame: parses, validates, logs and stores it.
+ * Runs in the pipeline worker thread, so it must only touch the sensor fields
+ * shared with the control path under sample_lock or atomically. Frames
+ * processed inline when the pipeline is full run here too, so the whole
+ * post-processing is serialized with process_lock
+ */
+void cws_process_sample(char* buff, void* arg){
+	LibSensor* self = (LibSensor*)arg;
+	char **strings;
+	int nstrings;
+
+	pthread_mutex_lock(&self->process_lock);
+	TRACE_BEGIN("process_sample", NULL);
+	// keep a copy of the raw frame, splitting it modifies the buffer
+	pthread_mutex_lock(&self->sample_lock);
+	strncpy(self->last_sample, buff, sizeof(self->last_sample) - 1);
+	self->last_sample_time = linux_get_epoch_time();
+	pthread_mutex_unlock(&self->sample_lock);
 
 	// WARNING: cws_get_substrings allocates memory
 	strings = cws_get_substrings(buff, ",", &nstrings);
 
 	if (nstrings != 10 ) {
 		speLOG(LOG_ERR, "Expected 10 fields, got %d", nstrings);
+		__atomic_add_fetch(&self->frames_bad, 1, __ATOMIC_RELAXED);
+		recorder_request("could not parse sample");
 		fastFree(strings);
-		return -1;
+		TRACE_END("process_sample", "error");
+		pthread_mutex_unlock(&self->process_lock);
+		return;
 	}
+	__atomic_add_fetch(&self->frames_ok, 1, __ATOMIC_RELAXED);
 
 	speLOG(LOG_INFO, "pH %s", strings[3]);
 	speLOG(LOG_INFO, "validity %s", strings[4]);
 	speLOG(LOG_INFO, "supply voltage %s V", strings[8]);
 	speLOG(LOG_INFO, "internal temp %s ºC", strings[9]);
 
+	cws_record rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.sensor = cws_parse_serial(strings[0]);
+	rec.timestamp = strtoll(strings[2], NULL, 10);
+	rec.ph = strtod(strings[3], NULL);
+	rec.valid = atoi(strings[4]);
+	rec.water_temp = strtod(strings[7], NULL);
+	rec.voltage = strtod(strings[8], NULL);
+	rec.internal_temp = strtod(strings[9], NULL);
+	history_append(&rec);
+	fastFree(strings);
+
 
 	/* I guess here we should put something like
 	 *  do {
@@ -461,8 +1206,8 @@ int cws_get_sample(LibSensor* self ){
 			i++;
 		} while (lsd_channel_next(self->sensor_data) > 0);
 	 */
-
-	return 0;
+	TRACE_END("process_sample", NULL);
+	pthread_mutex_unlock(&self->process_lock);
 }
 
 
@@ -475,15 +1220,15 @@ int cws_get_sample(LibSensor* self ){
 /*
  * Initializes the sensor
  */
-int sensor_init(LibSensor *self) {
+int sensor_init(LibSensor *self, cws_deadline deadline) {
 	//int tries = PROMPT_TRIES;
 	cws_state state = UNKNOWN;
 
-	TRY_CATCH(cws_send_command(self, "", PROMPT), "CWS 10101 Init failed!");
-	cws_sleep(1000);
-	TRY_CATCH(cws_send_command(self, "STOP", PROMPT), "could not send STOP");
-	cws_sleep(1000);
-	TRY_CATCH(cws_get_state(self, &state), "could not get state");
+	TRY_CATCH(cws_send_command(self, "", PROMPT, deadline_sub(deadline, CWS_PROMPT_TIMEOUT_MS)), "CWS 10101 Init failed!");
+	cws_sleep(deadline_clamp_ms(deadline, 1000));
+	TRY_CATCH(cws_send_command(self, "STOP", PROMPT, deadline_sub(deadline, CWS_PROMPT_TIMEOUT_MS)), "could not send STOP");
+	cws_sleep(deadline_clamp_ms(deadline, 1000));
+	TRY_CATCH(cws_get_state(self, &state, deadline_sub(deadline, CWS_STATE_TIMEOUT_MS)), "could not get state");
 	speLOG(LOG_DEBUG, "Current status %s", cws_states_str[state]);
 
 	speLOG(LOG_INFO, "CWS 10101 Initialized");
@@ -492,53 +1237,106 @@ int sensor_init(LibSensor *self) {
 
 
 /*
- * Perform a measure
+ * Reattaches to the sensor after a restart in the middle of a cycle, without
+ * stopping it. If the sensor is not in a state the cycle can go on from, it is
+ * initialized and the cycle starts from the beginning
  */
-int sensor_measure(LibSensor *self) {
-	speLOG(LOG_INFO, "Starting sensor measure");
-	TRY_CATCH(cws_send_command(self, "START", PROMPT), "could not send command START");
-
-	speLOG(LOG_INFO, "Waiting until IDLE state (timeout %d minutes)", CWS_MEAS_TIMEOUT_MIN);
-
-#ifdef SIMULATE_RESPONSE
-	cws_sleep(1000);
-	cws_wait_until_state(self, IDLE, 1000);
-	speLOG(LOG_WARNING, "HEADSUP!-> SIMULATING RESPONSE!!");
-	TRY_CATCH(cws_send_command(self, "STOP", PROMPT), "error in STOP");
-
-#else
-	// Simulator
-	TRY_CATCH(cws_wait_until_state(self, IDLE, CWS_MEAS_TIMEOUT_MIN*60*1000), "Sensor not going to SLEEP state, aborting measure");
-#endif
-
-	TRY_CATCH(cws_get_sample(self), "Sensor not going to IDLE state, aborting measure");
-
-
-	// TODO Start chlorinator here!
-	TRY_CATCH(cws_send_command(self, "SPECIAL1", PROMPT), "failed to send special1");
-	TRY_CATCH(cws_wait_until_state(self, OPERATING, 20000), "Timeout");
+int sensor_resume(LibSensor *self, cws_deadline deadline) {
+	cws_checkpoint* ck = &self->ckpt;
+	cws_state state = UNKNOWN;
 
-	// TODO adjust waiting time
-	speLOG(LOG_DEBUG, "Applying chlorinator for %d secs", CHLORINATOR_TIME_SECS);
-	cws_sleep(1000*CHLORINATOR_TIME_SECS);
+	TRY_CATCH(cws_send_command(self, "", PROMPT, deadline_sub(deadline, CWS_PROMPT_TIMEOUT_MS)), "CWS 10101 not answering");
+	TRY_CATCH(cws_get_state(self, &state, deadline_sub(deadline, CWS_STATE_TIMEOUT_MS)), "could not get state");
 
+	if (ck->phase == CKPT_MEASURING && state == IDLE) {
+		speLOG(LOG_INFO, "Measurement finished while the driver was down");
+		checkpoint_enter(ck, CKPT_SAMPLE, state);
+	}
+	else if (ck->phase == CKPT_MEASURING && state != OPERATING) {
+		speLOG(LOG_WARNING, "Sensor %s, can't resume the measurement, starting a new cycle", cws_states_str[state]);
+		checkpoint_enter(ck, CKPT_INIT, state);
+		return sensor_init(self, deadline);
+	}
+	speLOG(LOG_INFO, "Resuming cycle at phase %s (sensor %s, measuring for %.0f s)", ckpt_phase_str[ck->phase],
+			cws_states_str[state], linux_get_epoch_time() - ck->measure_start);
+	return 0;
+}
 
-	// TODO stop chlorinator here!
-	speLOG(LOG_DEBUG, "stopping chlorination");
-	TRY_CATCH(cws_send_command(self, "STOP", PROMPT), "failed to send stop");
-	TRY_CATCH(cws_wait_until_state(self, IDLE, 20000), "Sensor not going to IDLE state, aborting measure");
 
-	// TODO start rising mode
-	TRY_CATCH(cws_send_command(self, "SPECIAL2", PROMPT), "failed to send SPECIAL2");
-	TRY_CATCH(cws_wait_until_state(self, OPERATING, 20000), "Timeout");
+/*
+ * Perform a measure, starting from the phase of the cycle in the checkpoint
+ * (the beginning unless the cycle is being resumed). Every phase transition
+ * is saved to the checkpoint
+ */
+int sensor_measure(LibSensor *self, cws_deadline deadline) {
+	cws_checkpoint* ck = &self->ckpt;
+	int left_ms;
+
+	switch (ck->phase) {
+	case CKPT_NONE:
+	case CKPT_INIT:
+		speLOG(LOG_INFO, "Starting sensor measure");
+		TRY_CATCH(cws_send_command(self, "START", PROMPT, deadline_sub(deadline, CWS_PROMPT_TIMEOUT_MS)), "could not send command START");
+		checkpoint_enter(ck, CKPT_MEASURING, OPERATING);
+		/* fall through */
+
+	case CKPT_MEASURING:
+		// the measurement timeout counts from START, also when resumed
+		left_ms = (int)(1000*(ck->measure_start + 60*CWS_MEAS_TIMEOUT_MIN - linux_get_epoch_time()));
+		speLOG(LOG_INFO, "Waiting until IDLE state (timeout %d minutes)", CWS_MEAS_TIMEOUT_MIN);
 
+#ifdef SIMULATE_RESPONSE
+		cws_sleep(deadline_clamp_ms(deadline, 1000));
+		cws_wait_until_state(self, IDLE, deadline_sub(deadline, 1000));
+		speLOG(LOG_WARNING, "HEADSUP!-> SIMULATING RESPONSE!!");
+		TRY_CATCH(cws_send_command(self, "STOP", PROMPT, deadline_sub(deadline, CWS_PROMPT_TIMEOUT_MS)), "error in STOP");
 
-	// TODO adjust waiting time
-	speLOG(LOG_DEBUG, "Applyling Rising Mode for Waiting %d secs", RISING_MODE_TIME_SECS);
-	cws_sleep(1000*RISING_MODE_TIME_SECS);
-	speLOG(LOG_DEBUG, "stopping Rise mode");
-	TRY_CATCH(cws_send_command(self, "STOP", PROMPT), "failed to send stop");
-	TRY_CATCH(cws_wait_until_state(self, IDLE, 20000), "Sensor not going to IDLE state, aborting measure");
+#else
+		// Simulator
+		TRY_CATCH(cws_wait_until_state(self, IDLE, deadline_sub(deadline, left_ms > 0 ? left_ms : 0)), "Sensor not going to SLEEP state, aborting measure");
+#endif
+		checkpoint_enter(ck, CKPT_SAMPLE, IDLE);
+		/* fall through */
+
+	case CKPT_SAMPLE:
+		TRY_CATCH(cws_get_sample(self, deadline_sub(deadline, CWS_STATE_TIMEOUT_MS)), "Sensor not going to IDLE state, aborting measure");
+		// the phase only moves on once the sample is stored, a restart before
+		// that asks the sensor for it again
+		TRY_CATCH(pipeline_drain(deadline_sub(deadline, CWS_RESPONSE_TIMEOUT_MS)), "sample not processed in time");
+		checkpoint_enter(ck, CKPT_CHLORINATOR, IDLE);
+		/* fall through */
+
+	case CKPT_CHLORINATOR:
+		// TODO Start chlorinator here!
+		TRY_CATCH(cws_send_command(self, "SPECIAL1", PROMPT, deadline_sub(deadline, CWS_PROMPT_TIMEOUT_MS)), "failed to send special1");
+		TRY_CATCH(cws_wait_until_state(self, OPERATING, deadline_sub(deadline, CWS_STATE_TIMEOUT_MS)), "Timeout");
+
+		// TODO adjust waiting time
+		speLOG(LOG_DEBUG, "Applying chlorinator for %d secs", CHLORINATOR_TIME_SECS);
+		cws_idle(self, deadline_clamp_ms(deadline, 1000*CHLORINATOR_TIME_SECS), deadline);
+
+
+		// TODO stop chlorinator here!
+		speLOG(LOG_DEBUG, "stopping chlorination");
+		TRY_CATCH(cws_send_command(self, "STOP", PROMPT, deadline_sub(deadline, CWS_PROMPT_TIMEOUT_MS)), "failed to send stop");
+		TRY_CATCH(cws_wait_until_state(self, IDLE, deadline_sub(deadline, CWS_STATE_TIMEOUT_MS)), "Sensor not going to IDLE state, aborting measure");
+		checkpoint_enter(ck, CKPT_RINSE, IDLE);
+		/* fall through */
+
+	case CKPT_RINSE:
+		// TODO start rising mode
+		TRY_CATCH(cws_send_command(self, "SPECIAL2", PROMPT, deadline_sub(deadline, CWS_PROMPT_TIMEOUT_MS)), "failed to send SPECIAL2");
+		TRY_CATCH(cws_wait_until_state(self, OPERATING, deadline_sub(deadline, CWS_STATE_TIMEOUT_MS)), "Timeout");
+
+
+		// TODO adjust waiting time
+		speLOG(LOG_DEBUG, "Applyling Rising Mode for Waiting %d secs", RISING_MODE_TIME_SECS);
+		cws_idle(self, deadline_clamp_ms(deadline, 1000*RISING_MODE_TIME_SECS), deadline);
+		speLOG(LOG_DEBUG, "stopping Rise mode");
+		TRY_CATCH(cws_send_command(self, "STOP", PROMPT, deadline_sub(deadline, CWS_PROMPT_TIMEOUT_MS)), "failed to send stop");
+		TRY_CATCH(cws_wait_until_state(self, IDLE, deadline_sub(deadline, CWS_STATE_TIMEOUT_MS)), "Sensor not going to IDLE state, aborting measure");
+	}
 
+	checkpoint_enter(ck, CKPT_NONE, IDLE);
 	return 0;
 }
@@ -0,0 +1,160 @@
+/*
+ * Tests of the compressed history format: Gorilla encode/decode round trip
+ * and appending to a history file over several sessions, which resumes the
+ * encoder from the last block of the file.
+ *
+ *   $ make test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "cws_history.h"
+#include "cws_gorilla.h"
+
+#define TEST_RECORDS 1000
+#define TEST_SESSIONS 7  // appends are split in sessions of different sizes, crossing block boundaries
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		failures++; \
+	} \
+} while (0)
+
+
+/*
+ * Builds the i-th test record: irregular timestamps (also going back),
+ * repeated and changing values, NaN, infinities and validity changes
+ */
+static void make_record(int i, cws_record* rec){
+	memset(rec, 0, sizeof(cws_record));
+	rec->sensor = 10101;
+	rec->timestamp = 1690000000 + 600*(int64_t)i + ((i % 7 == 3) ? -1500 : (i % 5));
+	rec->ph = (i % 11 == 0) ? NAN : 8.0 + 0.001*(i % 13);
+	rec->water_temp = (i % 97 == 0) ? -INFINITY : 20.0 + 0.1*(i % 3);
+	rec->voltage = 11.5;
+	rec->internal_temp = (i % 50 < 25) ? 27.8 : -273.15 + i;
+	rec->valid = (i % 17 != 0);
+}
+
+
+/*
+ * Compares two records, floating point fields bit by bit so NaN matches NaN
+ */
+static int same_record(const cws_record* a, const cws_record* b){
+	return a->timestamp == b->timestamp && a->sensor == b->sensor && a->valid == b->valid &&
+			!memcmp(&a->ph, &b->ph, sizeof(double)) &&
+			!memcmp(&a->water_temp, &b->water_temp, sizeof(double)) &&
+			!memcmp(&a->voltage, &b->voltage, sizeof(double)) &&
+			!memcmp(&a->internal_temp, &b->internal_temp, sizeof(double));
+}
+
+
+static void test_gorilla_round_trip(){
+	static uint8_t buff[HISTORY_BLOCK_BYTES];
+	gorilla_stream stream = {buff, HISTORY_BLOCK_BYTES, 0};
+	gorilla_state enc, dec;
+	cws_record rec, out;
+	uint32_t pos = 0;
+	int i;
+
+	gorilla_init(&enc);
+	for (i = 0 ; i < HISTORY_BLOCK_RECORDS ; i++) {
+		make_record(i, &rec);
+		CHECK(gorilla_encode(&enc, &stream, &rec) == 0, "encode record %d", i);
+	}
+	CHECK(stream.bits <= (uint32_t)HISTORY_BLOCK_RECORDS*GORILLA_MAX_RECORD_BITS, "%u bits", stream.bits);
+
+	gorilla_init(&dec);
+	for (i = 0 ; i < HISTORY_BLOCK_RECORDS ; i++) {
+		make_record(i, &rec);
+		memset(&out, 0, sizeof(out));
+		out.sensor = rec.sensor;
+		CHECK(gorilla_decode(&dec, &stream, &pos, &out) == 0, "decode record %d", i);
+		CHECK(same_record(&rec, &out), "record %d differs after decoding", i);
+	}
+	CHECK(gorilla_decode(&dec, &stream, &pos, &out) < 0, "decoded past the end of the stream");
+	CHECK(pos == stream.bits, "decoder stopped at bit %u of %u", pos, stream.bits);
+}
+
+
+typedef struct {
+	int count;
+	int mismatches;
+}scan_result;
+
+static int check_scanned(const cws_record* rec, void* arg){
+	scan_result* r = (scan_result*)arg;
+	cws_record expected;
+	make_record(r->count, &expected);
+	if (!same_record(rec, &expected)) {
+		if (r->mismatches++ == 0) {
+			printf("FAIL record %d differs after reading the history\n", r->count);
+		}
+	}
+	r->count++;
+	return 0;
+}
+
+
+static void test_history_sessions(){
+	char path[] = "/tmp/cws_test_history.XXXXXX";
+	scan_result r;
+	cws_record rec;
+	int fd = mkstemp(path);
+	int session, i = 0;
+
+	CHECK(fd >= 0, "could not create %s", path);
+	if (fd < 0) {
+		return;
+	}
+	close(fd);
+	unlink(path); // history_open creates it with the compressed format
+
+	for (session = 0 ; session < TEST_SESSIONS ; session++) {
+		// sessions of 1, 2, 4... records and the rest in the last one
+		int end = (session == TEST_SESSIONS - 1) ? TEST_RECORDS : i + (1 << (2*session));
+		if (end > TEST_RECORDS) {
+			end = TEST_RECORDS;
+		}
+		CHECK(history_open(path) == 0, "open session %d", session);
+		for ( ; i < end ; i++) {
+			make_record(i, &rec);
+			CHECK(history_append(&rec) == 0, "append record %d", i);
+		}
+		history_close();
+
+		memset(&r, 0, sizeof(r));
+		CHECK(history_scan(path, 0, INT64_MIN, INT64_MAX, check_scanned, &r) == i, "scan after session %d", session);
+		CHECK(r.count == i && r.mismatches == 0, "session %d: %d records read, %d expected, %d differ",
+				session, r.count, i, r.mismatches);
+	}
+
+	// every part of the file read separately gives the same records
+	memset(&r, 0, sizeof(r));
+	for (session = 0 ; session < 3 ; session++) {
+		CHECK(history_scan_part(path, session, 3, 0, INT64_MIN, INT64_MAX, check_scanned, &r) >= 0, "scan part %d", session);
+	}
+	CHECK(r.count == TEST_RECORDS && r.mismatches == 0, "parts: %d records read, %d differ", r.count, r.mismatches);
+	unlink(path);
+}
+
+
+int main(){
+	test_gorilla_round_trip();
+	test_history_sessions();
+	if (failures > 0) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("history tests passed\n");
+	return 0;
+}